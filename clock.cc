@@ -0,0 +1,51 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "clock.h"
+
+#include <errno.h>
+
+namespace touch_keyboard {
+
+struct timespec AddMsToTimespec(struct timespec const &orig,
+                                int additional_ms) {
+  struct timespec extended = orig;
+  extended.tv_nsec += additional_ms * 1e6;
+  while (extended.tv_nsec >= 1e9) {
+    extended.tv_nsec -= 1e9;
+    extended.tv_sec += 1;
+  }
+  return extended;
+}
+
+bool TimespecIsLater(struct timespec const &t1, struct timespec const &t2) {
+  return ((t1.tv_sec > t2.tv_sec) ||
+          (t1.tv_sec == t2.tv_sec && t1.tv_nsec > t2.tv_nsec));
+}
+
+int MsBetween(struct timespec const &t1, struct timespec const &t2) {
+  return (t2.tv_sec - t1.tv_sec) * 1000 + (t2.tv_nsec - t1.tv_nsec) / 1000000;
+}
+
+struct timespec RealClock::Now() const {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now;
+}
+
+void RealClock::WaitUntil(struct timespec const &deadline) {
+  // The sleep is absolute, so being interrupted by a signal just means going
+  // back to sleep.
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+         EINTR) {
+  }
+}
+
+void VirtualClock::WaitUntil(struct timespec const &deadline) {
+  if (TimespecIsLater(deadline, now_)) {
+    now_ = deadline;
+  }
+}
+
+}  // namespace touch_keyboard
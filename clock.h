@@ -0,0 +1,78 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_CLOCK_H_
+#define TOUCH_KEYBOARD_CLOCK_H_
+
+#include <time.h>
+
+#include "base_macros.h"
+
+namespace touch_keyboard {
+
+// Points in time are struct timespecs on CLOCK_MONOTONIC, like the kernel's
+// event timestamps and the timerfd deadlines they are compared with.
+
+// Return orig moved additional_ms later.
+struct timespec AddMsToTimespec(struct timespec const &orig,
+                                int additional_ms);
+
+// True if t1 comes *after* t2.
+bool TimespecIsLater(struct timespec const &t1, struct timespec const &t2);
+
+// The number of whole milliseconds from t1 until t2.
+int MsBetween(struct timespec const &t1, struct timespec const &t2);
+
+class Clock {
+ /* Where the time comes from, for anything that waits for deadlines.
+  *
+  * Like SyscallHandler does for syscalls, this lets the time be replaced: the
+  * RealClock reads and sleeps on CLOCK_MONOTONIC, while a VirtualClock only
+  * moves when it's told to, and waiting on it takes no time at all.  That way
+  * a recording can be pushed through the same logic far faster than real
+  * time, and always gives the same result.
+  */
+ public:
+  virtual ~Clock() {}
+
+  virtual struct timespec Now() const = 0;
+
+  // Return once deadline has passed, straight away if it already has.
+  virtual void WaitUntil(struct timespec const &deadline) = 0;
+};
+
+class RealClock : public Clock {
+ public:
+  RealClock() {}
+
+  struct timespec Now() const override;
+  void WaitUntil(struct timespec const &deadline) override;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(RealClock);
+};
+
+class VirtualClock : public Clock {
+ /* A clock that stands still until it's moved.
+  *
+  * Waiting for a deadline jumps straight to it.  The clock never goes back,
+  * waiting for a deadline that has already passed leaves it where it is.
+  */
+ public:
+  VirtualClock() : now_({0, 0}) {}
+
+  struct timespec Now() const override { return now_; }
+  void WaitUntil(struct timespec const &deadline) override;
+
+ private:
+  struct timespec now_;
+
+  DISALLOW_COPY_AND_ASSIGN(VirtualClock);
+};
+
+static RealClock default_clock;
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_CLOCK_H_
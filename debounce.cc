@@ -0,0 +1,276 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "debounce.h"
+
+#include <fcntl.h>
+#include <logging.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+
+namespace touch_keyboard {
+
+namespace {
+
+// The percentile of the rejection latencies the delay grows to.
+constexpr double kRejectionQuantile = 0.9;
+
+// How quickly the rejection rate follows new touches.  Roughly the last
+// 1 / kRejectionRateAlpha touches count.
+constexpr double kRejectionRateAlpha = 0.02;
+
+// At this rejection rate and above, the delay is the full rejection
+// percentile.
+constexpr double kFullRejectionRate = 0.1;
+
+// How many touches have to be seen before the delay is adapted at all.
+constexpr uint64_t kMinObservations = 20;
+
+// The state file starts with this magic and version.
+constexpr char kDebounceStateMagic[8] = "TKBDDEB";
+constexpr uint32_t kDebounceStateVersion = 1;
+
+struct DebounceState {
+  char magic_[8];
+  uint32_t version_;
+  uint32_t size_;
+  uint64_t observations_;
+  double rejection_rate_;
+  P2State rejection_latency_;
+  P2State tap_duration_;
+};
+
+}  // namespace
+
+P2Quantile::P2Quantile(double p) : p_(p), count_(0) {
+  for (int i = 0; i < 5; i++) {
+    heights_[i] = 0;
+    positions_[i] = i + 1;
+  }
+  UpdateDesiredPositions();
+}
+
+void P2Quantile::UpdateDesiredPositions() {
+  // The desired positions start out at these and each sample moves them
+  // along by the increments, so they can be computed from the count.
+  double const initial[5] = {1, 1 + 2 * p_, 1 + 4 * p_, 3 + 2 * p_, 5};
+  double const increment[5] = {0, p_ / 2, p_, (1 + p_) / 2, 1};
+  double extra = count_ > 5 ? count_ - 5 : 0;
+  for (int i = 0; i < 5; i++) {
+    desired_[i] = initial[i] + extra * increment[i];
+  }
+}
+
+void P2Quantile::Add(double x) {
+  // The first five samples simply become the markers.
+  if (count_ < 5) {
+    heights_[count_++] = x;
+    if (count_ == 5) {
+      std::sort(heights_, heights_ + 5);
+    }
+    return;
+  }
+  count_++;
+
+  // Find the cell the sample falls into, stretching the extremes if needed,
+  // and shift the markers above it.
+  int cell;
+  if (x < heights_[0]) {
+    heights_[0] = x;
+    cell = 0;
+  } else if (x >= heights_[4]) {
+    heights_[4] = x;
+    cell = 3;
+  } else {
+    cell = 0;
+    while (x >= heights_[cell + 1]) {
+      cell++;
+    }
+  }
+  for (int i = cell + 1; i < 5; i++) {
+    positions_[i]++;
+  }
+  UpdateDesiredPositions();
+
+  // Move the middle markers that are off their desired position by a whole
+  // step or more, as long as they don't run into their neighbours.
+  for (int i = 1; i < 4; i++) {
+    double d = desired_[i] - positions_[i];
+    if ((d >= 1 && positions_[i + 1] - positions_[i] > 1) ||
+        (d <= -1 && positions_[i - 1] - positions_[i] < -1)) {
+      int s = d >= 0 ? 1 : -1;
+      double n_below = positions_[i] - positions_[i - 1];
+      double n_above = positions_[i + 1] - positions_[i];
+      double parabolic = heights_[i] +
+          s / (n_below + n_above) *
+          ((n_below + s) * (heights_[i + 1] - heights_[i]) / n_above +
+           (n_above - s) * (heights_[i] - heights_[i - 1]) / n_below);
+      if (heights_[i - 1] < parabolic && parabolic < heights_[i + 1]) {
+        heights_[i] = parabolic;
+      } else {
+        heights_[i] += s * (heights_[i + s] - heights_[i]) /
+                       (positions_[i + s] - positions_[i]);
+      }
+      positions_[i] += s;
+    }
+  }
+}
+
+double P2Quantile::Get() const {
+  if (count_ >= 5) {
+    return heights_[2];
+  }
+  if (count_ == 0) {
+    return 0;
+  }
+  // With only a few samples, pick the nearest one.
+  double sorted[5];
+  std::copy(heights_, heights_ + count_, sorted);
+  std::sort(sorted, sorted + count_);
+  return sorted[static_cast<int>(std::lround(p_ * (count_ - 1)))];
+}
+
+P2State P2Quantile::GetState() const {
+  P2State state;
+  state.count_ = count_;
+  std::copy(heights_, heights_ + 5, state.heights_);
+  std::copy(positions_, positions_ + 5, state.positions_);
+  return state;
+}
+
+bool P2Quantile::SetState(P2State const &state) {
+  // The markers have to be in order, both in height and in position.
+  if (state.count_ >= 5) {
+    if (state.positions_[0] != 1 ||
+        static_cast<uint64_t>(state.positions_[4]) != state.count_) {
+      return false;
+    }
+    for (int i = 0; i < 4; i++) {
+      if (!(state.heights_[i] <= state.heights_[i + 1]) ||
+          state.positions_[i] >= state.positions_[i + 1]) {
+        return false;
+      }
+    }
+  }
+  count_ = state.count_;
+  std::copy(state.heights_, state.heights_ + 5, heights_);
+  std::copy(state.positions_, state.positions_ + 5, positions_);
+  UpdateDesiredPositions();
+  return true;
+}
+
+DebounceEstimator::DebounceEstimator(int initial_ms, int min_ms, int max_ms) :
+    initial_ms_(initial_ms), min_ms_(min_ms), max_ms_(std::max(min_ms, max_ms)),
+    delay_ms_(initial_ms), observations_(0), rejection_rate_(0),
+    rejection_latency_(kRejectionQuantile), tap_duration_(0.5) {
+  UpdateDelay();
+}
+
+void DebounceEstimator::AddTap(int duration_ms) {
+  tap_duration_.Add(duration_ms);
+  rejection_rate_ += kRejectionRateAlpha * (0 - rejection_rate_);
+  observations_++;
+  UpdateDelay();
+}
+
+void DebounceEstimator::AddRejection(int latency_ms) {
+  // A rejection long after the longest delay couldn't have been caught
+  // anyway, so it only counts as much as one right at the limit.
+  rejection_latency_.Add(std::min(latency_ms, max_ms_));
+  rejection_rate_ += kRejectionRateAlpha * (1 - rejection_rate_);
+  observations_++;
+  UpdateDelay();
+}
+
+void DebounceEstimator::UpdateDelay() {
+  if (observations_ < kMinObservations) {
+    delay_ms_ = std::min(std::max(initial_ms_, min_ms_), max_ms_);
+    return;
+  }
+
+  // Without rejections there is no reason to wait longer than the minimum.
+  // The more often touches get rejected, the closer the delay comes to the
+  // time it takes to catch most of them.
+  double target = min_ms_;
+  if (rejection_latency_.count() > 0) {
+    double weight = std::min(rejection_rate_ / kFullRejectionRate, 1.0);
+    target += weight * (rejection_latency_.Get() - min_ms_);
+  }
+  delay_ms_ = std::min(std::max(static_cast<int>(std::lround(target)),
+                                min_ms_), max_ms_);
+}
+
+bool DebounceEstimator::Load(std::string const &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    PLOG(INFO) << "No debounce state in " << path << ", starting afresh\n";
+    return false;
+  }
+  DebounceState state;
+  ssize_t size = ::read(fd, &state, sizeof(state));
+  ::close(fd);
+
+  P2State rejection_latency = rejection_latency_.GetState();
+  P2State tap_duration = tap_duration_.GetState();
+  if (size != sizeof(state) ||
+      memcmp(state.magic_, kDebounceStateMagic, sizeof(state.magic_)) ||
+      state.version_ != kDebounceStateVersion ||
+      state.size_ != sizeof(state) ||
+      !(state.rejection_rate_ >= 0 && state.rejection_rate_ <= 1) ||
+      !rejection_latency_.SetState(state.rejection_latency_) ||
+      !tap_duration_.SetState(state.tap_duration_)) {
+    LOG(WARNING) << "Ignoring unusable debounce state in " << path << "\n";
+    rejection_latency_.SetState(rejection_latency);
+    tap_duration_.SetState(tap_duration);
+    return false;
+  }
+  observations_ = state.observations_;
+  rejection_rate_ = state.rejection_rate_;
+  UpdateDelay();
+  LogState();
+  return true;
+}
+
+bool DebounceEstimator::Save(std::string const &path) const {
+  DebounceState state;
+  memset(&state, 0, sizeof(state));
+  memcpy(state.magic_, kDebounceStateMagic, sizeof(state.magic_));
+  state.version_ = kDebounceStateVersion;
+  state.size_ = sizeof(state);
+  state.observations_ = observations_;
+  state.rejection_rate_ = rejection_rate_;
+  state.rejection_latency_ = rejection_latency_.GetState();
+  state.tap_duration_ = tap_duration_.GetState();
+
+  // Write a new file and move it over the old one, so a crash never leaves
+  // a half written state behind.
+  std::string tmp_path = path + ".tmp";
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to create " << tmp_path << "\n";
+    return false;
+  }
+  bool ok = ::write(fd, &state, sizeof(state)) == sizeof(state);
+  ok = (::close(fd) == 0) && ok;
+  if (!ok || ::rename(tmp_path.c_str(), path.c_str()) < 0) {
+    PLOG(ERROR) << "Unable to save the debounce state to " << path << "\n";
+    ::unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+void DebounceEstimator::LogState() const {
+  LOG(INFO) << "Debounce delay " << delay_ms_ << " ms after " <<
+               observations_ << " touches: rejection rate " <<
+               rejection_rate_ << ", " << kRejectionQuantile * 100 <<
+               "th percentile rejection after " << rejection_latency_.Get() <<
+               " ms, median tap " << tap_duration_.Get() << " ms.\n";
+}
+
+}  // namespace touch_keyboard
@@ -0,0 +1,132 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_DEBOUNCE_H_
+#define TOUCH_KEYBOARD_DEBOUNCE_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+
+namespace touch_keyboard {
+
+// Everything needed to restore a P2Quantile, for saving it to a file.
+struct P2State {
+  uint64_t count_;
+  double heights_[5];
+  int64_t positions_[5];
+};
+
+class P2Quantile {
+ /* An online estimate of a single quantile of a stream of samples.
+  *
+  * This is the P-square algorithm of Jain and Chlamtac: five markers track the
+  * minimum, the maximum, the quantile and two points half way to it, and each
+  * new sample nudges them with a piecewise-parabolic fit.  It takes constant
+  * memory and time per sample, and the whole state is a handful of numbers,
+  * so it's easily saved and restored.
+  */
+ public:
+  explicit P2Quantile(double p);
+
+  void Add(double x);
+
+  // The current estimate, or 0 if there have been no samples yet.
+  double Get() const;
+
+  uint64_t count() const { return count_; }
+
+  P2State GetState() const;
+
+  // Restore a state from GetState().  Returns false, leaving the estimate
+  // untouched, if the state is inconsistent.
+  bool SetState(P2State const &state);
+
+ private:
+  // Recompute the desired marker positions from count_, eg. after the markers
+  // were restored from a saved state.
+  void UpdateDesiredPositions();
+
+  double p_;
+  uint64_t count_;
+
+  // The marker heights and their actual and desired positions.  Until there
+  // are five samples, heights_ simply holds them.
+  double heights_[5];
+  int64_t positions_[5];
+  double desired_[5];
+};
+
+// The bounds the adaptive debounce delay stays in, unless configured
+// otherwise.
+constexpr int kDefaultMinDebounceMS = 20;
+constexpr int kDefaultMaxDebounceMS = 80;
+
+class DebounceEstimator {
+ /* Learns how long key events should be held back before they are sent.
+  *
+  * Every key event waits a little while, so a touch that turns out not to be
+  * a tap (eg. because the finger slides off the key) can still be rejected.
+  * The longer the wait, the more of these are caught, but every clean tap
+  * pays for it in latency.  This estimator watches how a user's touches end
+  * and picks a delay that suits them:
+  *
+  *  - For rejected touches, it tracks the 90th percentile of how long after
+  *    touchdown the rejection came, which is how long the delay has to be to
+  *    catch most of them.
+  *  - It keeps a moving average of how many touches get rejected at all.  The
+  *    delay goes from the minimum, for someone whose taps are all clean, up to
+  *    the rejection percentile as the rejection rate rises.
+  *  - Tap durations are tracked as well, and reported with the rest.
+  *
+  * The delay is always kept within [min_ms, max_ms].  Until enough touches
+  * have been seen, initial_ms is used.  The learned state can be saved to a
+  * small file and loaded again on the next start.
+  */
+ public:
+  DebounceEstimator(int initial_ms, int min_ms, int max_ms);
+
+  // Record a touch that ended as a clean tap after duration_ms.
+  void AddTap(int duration_ms);
+
+  // Record a touch that was rejected latency_ms after it touched down.
+  void AddRejection(int latency_ms);
+
+  // The delay to use for new events.
+  int DelayMS() const { return delay_ms_; }
+
+  // The longest delay it will ever pick.
+  int max_ms() const { return std::max(initial_ms_, max_ms_); }
+
+  // The number of touches seen, including those from a loaded state.
+  uint64_t observations() const { return observations_; }
+
+  // Restore a state written by Save().  If the file is missing or unusable,
+  // false is returned and the estimator starts from scratch.
+  bool Load(std::string const &path);
+
+  // Write the state to path, replacing the previous file atomically.
+  bool Save(std::string const &path) const;
+
+  void LogState() const;
+
+ private:
+  // Recompute delay_ms_ from the statistics.
+  void UpdateDelay();
+
+  int initial_ms_, min_ms_, max_ms_;
+  int delay_ms_;
+
+  uint64_t observations_;
+
+  // The moving average of the fraction of touches that were rejected.
+  double rejection_rate_;
+
+  P2Quantile rejection_latency_;
+  P2Quantile tap_duration_;
+};
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_DEBOUNCE_H_
@@ -6,19 +6,70 @@
 
 namespace touch_keyboard {
 
+EvdevSource::~EvdevSource() {
+  if (source_fd_ >= 0) {
+    if (grabbed_) {
+      GrabSourceDevice(false);
+    }
+    syscall_handler_->close(source_fd_);
+  }
+}
+
+bool EvdevSource::GrabSourceDevice(bool grab) {
+  uint64_t arg = grab ? 1 : 0;
+  int error = syscall_handler_->ioctl(source_fd_, EVIOCGRAB, arg);
+  if (error) {
+    PLOG(ERROR) << "Unable to " << (grab ? "grab" : "release") <<
+                   " the source device (" << error << ")\n";
+    return false;
+  }
+  grabbed_ = grab;
+  LOG(INFO) << (grab ? "Grabbed" : "Released") << " the source device.\n";
+  return true;
+}
+
 bool EvdevSource::OpenSourceDevice(std::string const &source_device_path) {
   source_fd_ = syscall_handler_->open(source_device_path.c_str(), O_RDONLY);
   if (source_fd_ < 0) {
     PLOG(ERROR) << "Failed to open() source device " << source_device_path << ". (" << source_fd_ << ")\n";
     return false;
   }
+
+  int32_t clock_id = CLOCK_MONOTONIC;
+  monotonic_timestamps_ =
+      (syscall_handler_->ioctl(source_fd_, EVIOCSCLOCKID, &clock_id) == 0);
+  if (!monotonic_timestamps_) {
+    LOG(WARNING) << "Unable to switch the source device to monotonic " <<
+                    "timestamps.\n";
+  }
+
+  int64_t abs_bits = 0;
+  if (syscall_handler_->ioctl(source_fd_, EVIOCGBIT(EV_ABS, sizeof(abs_bits)),
+                              &abs_bits) < 0) {
+    PLOG(WARNING) << "Unable to query the axes of the source device.\n";
+  }
+  abs_bits_ = abs_bits;
   return true;
 }
 
-bool EvdevSource::GetNextEvent(int timeout_ms, struct input_event *ev) const {
+int EvdevSource::GetNumSlots() {
+  struct input_absinfo slot_info;
+  if (syscall_handler_->ioctl(source_fd_, EVIOCGABS(ABS_MT_SLOT),
+                              &slot_info) < 0) {
+    return -1;
+  }
+  return slot_info.maximum + 1;
+}
+
+bool EvdevSource::GetNextEvent(int timeout_ms, struct input_event *ev) {
+  // Serve events left over from a previous read() before going to the device.
+  if (GetBufferedEvent(ev)) {
+    return true;
+  }
+
   if (timeout_ms > 0) {
     int num_ready;
-    struct timeval timeout = {0, timeout_ms * 1000};
+    struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
     fd_set set;
 
     // Block until there's something to read or we hit a timeout.
@@ -33,16 +84,97 @@ bool EvdevSource::GetNextEvent(int timeout_ms, struct input_event *ev) const {
     }
   }
 
-  int num_bytes_read = syscall_handler_->read(source_fd_, ev, sizeof(*ev));
-  if (num_bytes_read != sizeof(*ev)) {
-    PLOG(ERROR) << "ERROR: A read failed to read an entire event. Only read " <<
-                   num_bytes_read << " of " << sizeof(*ev) << "expected bytes.\n";
+  if (!FillEventBuffer()) {
+    return false;
+  }
+  return GetBufferedEvent(ev);
+}
+
+bool EvdevSource::FillEventBuffer() {
+  // Read into the contiguous free space following the newest buffered event.
+  // If the free space wraps around the end of the ring only the first part is
+  // used, the rest is picked up by the next read().
+  int tail = (buffer_head_ + buffer_count_) % kEventBufferSize;
+  int space = std::min(kEventBufferSize - tail,
+                       kEventBufferSize - buffer_count_);
+  if (space == 0) {
+    LOG(WARNING) << "Event buffer is full, not reading from the device.\n";
+    return true;
+  }
+
+  int num_bytes_read = syscall_handler_->read(source_fd_, &event_buffer_[tail],
+                                              space * sizeof(struct input_event));
+  if (num_bytes_read == 0) {
+    // Only a replayed source ever runs out of events.
+    LOG(INFO) << "Reached the end of the source device's events.\n";
+    return false;
+  }
+  if (num_bytes_read < 0 ||
+      num_bytes_read % sizeof(struct input_event) != 0) {
+    PLOG(ERROR) << "ERROR: A read failed to read an entire event. Read " <<
+                   num_bytes_read << " bytes, expected a multiple of " <<
+                   sizeof(struct input_event) << ".\n";
     if (num_bytes_read == -1) {
 	    throw "Evdev read() failed";
     }
     return false;
   }
+
+  int num_events = num_bytes_read / sizeof(struct input_event);
+  if (recorder_) {
+    recorder_->Append(&event_buffer_[tail], num_events);
+  }
+  buffer_count_ += num_events;
+  return true;
+}
+
+bool EvdevSource::GetBufferedEvent(struct input_event *ev) {
+  if (buffer_count_ == 0) {
+    return false;
+  }
+  *ev = event_buffer_[buffer_head_];
+  buffer_head_ = (buffer_head_ + 1) % kEventBufferSize;
+  buffer_count_--;
   return true;
 }
 
+bool EvdevSource::ResyncStateMachine(
+    mtstatemachine::MtStateMachine *sm,
+    struct mtstatemachine::MtFrame *out_frame) {
+  bool success = true;
+  LOG(WARNING) << "Events were dropped, resyncing the touch state.\n";
+
+  // Find out which slot the device is currently pointing at.
+  struct input_absinfo slot_info;
+  if (syscall_handler_->ioctl(source_fd_, EVIOCGABS(ABS_MT_SLOT),
+                              &slot_info) == 0) {
+    sm->SetCurrentSlot(slot_info.value);
+  } else {
+    success = false;
+  }
+
+  // Query each multitouch axis for all the slots at once.  The first value is
+  // the axis code, followed by one value per slot.  EVIOCGMTSLOTS succeeds for
+  // any multitouch code and returns zeros for axes the device doesn't have, so
+  // only the axes it reported are asked for.  The others have to stay unset,
+  // or eg. a missing pressure would turn into a pressure of 0.
+  int32_t values[mtstatemachine::kMaxSlots + 1];
+  for (int code = ABS_MT_TOUCH_MAJOR; code <= ABS_MT_TOOL_Y; code++) {
+    if (!((abs_bits_ >> code) & 1)) {
+      continue;
+    }
+    values[0] = code;
+    if (syscall_handler_->ioctl(source_fd_, EVIOCGMTSLOTS(sizeof(values)),
+                                values) < 0) {
+      continue;
+    }
+    for (int slot = 0; slot < sm->num_slots(); slot++) {
+      sm->SetSlotValue(slot, code, values[slot + 1]);
+    }
+  }
+
+  sm->FinishResync(out_frame);
+  return success;
+}
+
 }  // namespace touch_keyboard
@@ -5,6 +5,7 @@
 #ifndef TOUCH_KEYBOARD_EVDEVSOURCE_H_
 #define TOUCH_KEYBOARD_EVDEVSOURCE_H_
 
+#include <algorithm>
 #include <logging.h>
 #include <fcntl.h>
 #include <linux/input.h>
@@ -15,6 +16,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "recording.h"
+#include "statemachine/statemachine.h"
 #include "syscallhandler.h"
 
 namespace touch_keyboard {
@@ -23,6 +26,11 @@ namespace touch_keyboard {
 // when calling GetNextEvent().
 constexpr int kNoTimeout = -1;
 
+// The number of input events EvdevSource can hold between reads.  A single
+// frame with ten fingers down is well under a hundred events, so this is
+// enough to drain several complete frames with one read().
+constexpr int kEventBufferSize = 256;
+
 class EvdevSource {
  /* A class that uses an Evdev device as an event source
   *
@@ -32,12 +40,21 @@ class EvdevSource {
   * should call OpenSourceDevice() at the beginning, then repeatedly
   * call GetNextEvent() to collect up the individual events being produced
   * by the Evdev device you selected.
+  *
+  * Events are not read from the device one at a time.  Instead each read()
+  * drains as many events as the kernel has queued into an internal ring
+  * buffer and GetNextEvent() hands them out from there, so a whole frame (up
+  * to and including its SYN_REPORT) usually costs a single syscall.
   */
  public:
   EvdevSource() : syscall_handler_(&default_syscall_handler),
-                  source_fd_(-1) { }
+                  source_fd_(-1), monotonic_timestamps_(false),
+                  abs_bits_(0), grabbed_(false), recorder_(NULL),
+                  buffer_head_(0), buffer_count_(0) { }
   explicit EvdevSource(SyscallHandler *syscall_handler) :
-      syscall_handler_(syscall_handler), source_fd_(-1) {
+      syscall_handler_(syscall_handler), source_fd_(-1),
+      monotonic_timestamps_(false), abs_bits_(0), grabbed_(false),
+      recorder_(NULL), buffer_head_(0), buffer_count_(0) {
     // This constructor allows you to pass in a SyscallHandler when unit
     // testing this class.  For real use, allow it to use the default value
     // by using the constructor with no arguments.
@@ -47,14 +64,73 @@ class EvdevSource {
     }
   }
 
+  ~EvdevSource();
+
+  // Take (or give up) exclusive access to the source device with EVIOCGRAB.
+  // While grabbed, no other client of the device -- libinput and the
+  // compositor included -- receives its events.  The grab belongs to the open
+  // file, so the kernel drops it whenever the descriptor is closed, which
+  // includes the process exiting or crashing.
+  bool GrabSourceDevice(bool grab);
+
+  // From now on, append every event read from the source device to recorder.
+  void SetRecorder(EvdevRecorder *recorder) { recorder_ = recorder; }
+
  protected:
   // Open the device file on disk and store the descriptor in this object.
+  // The device is also switched to CLOCK_MONOTONIC timestamps, so the event
+  // times can be compared directly with deadlines on the monotonic clock, and
+  // the axes it reports are looked up once.
   bool OpenSourceDevice(std::string const &source_device_path);
+
+  // Query how many multitouch slots the source device has, or return -1 if
+  // it doesn't report ABS_MT_SLOT.
+  int GetNumSlots();
+
   // Wait for a new event to come from the source and populate *ev with it.
-  bool GetNextEvent(int timeout_ms, struct input_event *ev) const;
+  // If there are still buffered events from an earlier read() this returns
+  // the next one immediately without touching the device.
+  bool GetNextEvent(int timeout_ms, struct input_event *ev);
+
+  // Perform a single read() on the source device, appending every event it
+  // returns to the internal buffer.  This blocks if nothing is available.
+  bool FillEventBuffer();
+
+  // Pop the oldest buffered event into *ev.  Returns false if the buffer is
+  // empty, in which case FillEventBuffer() has to be called first.
+  bool GetBufferedEvent(struct input_event *ev);
+
+  // Rebuild the state of every slot in sm from the device after it reported
+  // dropped events, then fill out_frame (if not NULL) with the result.
+  // All slots are fetched with one EVIOCGMTSLOTS query per axis the device
+  // reports.
+  bool ResyncStateMachine(mtstatemachine::MtStateMachine *sm,
+                          struct mtstatemachine::MtFrame *out_frame);
 
   SyscallHandler *syscall_handler_;
   int source_fd_;
+
+  // True if the kernel agreed to stamp this device's events with
+  // CLOCK_MONOTONIC.  If not, the timestamps are on CLOCK_REALTIME.
+  bool monotonic_timestamps_;
+
+  // One bit per ABS_* axis the source device reports, as EVIOCGBIT(EV_ABS)
+  // returned it when the device was opened.
+  uint64_t abs_bits_;
+
+ private:
+  // True while this object holds an exclusive grab on the source device.
+  bool grabbed_;
+
+  // If set, the recording all events read are written to.
+  EvdevRecorder *recorder_;
+
+  // A ring buffer of events that have been read from the device but not yet
+  // handed out by GetNextEvent().  buffer_head_ is the index of the oldest
+  // event and buffer_count_ is how many events are currently stored.
+  struct input_event event_buffer_[kEventBufferSize];
+  int buffer_head_;
+  int buffer_count_;
 };
 
 }  // namespace touch_keyboard
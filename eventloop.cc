@@ -0,0 +1,151 @@
+// Copyright 2016 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "eventloop.h"
+
+#include <errno.h>
+
+namespace touch_keyboard {
+
+EventLoop::~EventLoop() {
+  if (timer_fd_ >= 0) {
+    syscall_handler_->close(timer_fd_);
+  }
+  if (epoll_fd_ >= 0) {
+    syscall_handler_->close(epoll_fd_);
+  }
+}
+
+bool EventLoop::Init() {
+  epoll_fd_ = syscall_handler_->epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0) {
+    PLOG(ERROR) << "Unable to create epoll instance (" << epoll_fd_ << ")\n";
+    return false;
+  }
+
+  timer_fd_ = syscall_handler_->timerfd_create(CLOCK_MONOTONIC,
+                                               TFD_CLOEXEC | TFD_NONBLOCK);
+  if (timer_fd_ < 0) {
+    PLOG(ERROR) << "Unable to create timerfd (" << timer_fd_ << ")\n";
+    return false;
+  }
+
+  return AddFd(timer_fd_, [this]() { HandleTimerExpiry(); });
+}
+
+bool EventLoop::AddFd(int fd, FdHandler handler) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  int error = syscall_handler_->epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+  if (error) {
+    PLOG(ERROR) << "Unable to add fd " << fd << " to epoll (" << error << ")\n";
+    return false;
+  }
+  fd_handlers_[fd] = handler;
+  return true;
+}
+
+bool EventLoop::RemoveFd(int fd) {
+  fd_handlers_.erase(fd);
+  int error = syscall_handler_->epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+  if (error) {
+    PLOG(ERROR) << "Unable to remove fd " << fd << " from epoll (" << error <<
+                   ")\n";
+    return false;
+  }
+  return true;
+}
+
+bool EventLoop::SetDeadline(struct timespec const &deadline) {
+  // Skip the syscall entirely if the timer is already armed for this exact
+  // deadline, which is the common case while the head of a queue is waiting.
+  if (timer_armed_ && deadline_.tv_sec == deadline.tv_sec &&
+      deadline_.tv_nsec == deadline.tv_nsec) {
+    return true;
+  }
+
+  struct itimerspec spec = {{0, 0}, deadline};
+  // A zero it_value would disarm the timer instead of firing it, so nudge a
+  // deadline at the very start of the clock forward by a nanosecond.
+  if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+    spec.it_value.tv_nsec = 1;
+  }
+  int error = syscall_handler_->timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME,
+                                                &spec, NULL);
+  if (error) {
+    PLOG(ERROR) << "Unable to arm timerfd (" << error << ")\n";
+    return false;
+  }
+  timer_armed_ = true;
+  deadline_ = deadline;
+  return true;
+}
+
+bool EventLoop::ClearDeadline() {
+  if (!timer_armed_) {
+    return true;
+  }
+
+  struct itimerspec spec = {{0, 0}, {0, 0}};
+  int error = syscall_handler_->timerfd_settime(timer_fd_, 0, &spec, NULL);
+  if (error) {
+    PLOG(ERROR) << "Unable to disarm timerfd (" << error << ")\n";
+    return false;
+  }
+  timer_armed_ = false;
+  return true;
+}
+
+void EventLoop::HandleTimerExpiry() {
+  // Drain the expiration count so the timerfd stops reporting readable.  If
+  // the timer was re-armed or disarmed in the meantime this read fails with
+  // EAGAIN and there is nothing to do.
+  uint64_t expirations;
+  if (syscall_handler_->read(timer_fd_, &expirations, sizeof(expirations)) !=
+      sizeof(expirations)) {
+    return;
+  }
+  if (!timer_armed_) {
+    return;
+  }
+
+  timer_armed_ = false;
+  if (timer_handler_) {
+    timer_handler_(deadline_);
+  }
+}
+
+bool EventLoop::RunOnce() {
+  struct epoll_event events[kMaxEventsPerWait];
+  int num_ready = syscall_handler_->epoll_wait(epoll_fd_, events,
+                                               kMaxEventsPerWait, -1);
+  if (num_ready < 0) {
+    if (errno == EINTR) {
+      return true;
+    }
+    PLOG(ERROR) << "epoll_wait() failed (" << num_ready << ")\n";
+    return false;
+  }
+
+  for (int i = 0; i < num_ready; i++) {
+    auto it = fd_handlers_.find(events[i].data.fd);
+    if (it != fd_handlers_.end()) {
+      // Copy the handler out in case it removes its own fd while running.
+      FdHandler handler = it->second;
+      handler();
+    }
+  }
+  return true;
+}
+
+void EventLoop::Run() {
+  while (!quit_) {
+    if (!RunOnce()) {
+      throw "Event loop failed";
+    }
+  }
+}
+
+}  // namespace touch_keyboard
@@ -0,0 +1,106 @@
+// Copyright 2016 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_EVENTLOOP_H_
+#define TOUCH_KEYBOARD_EVENTLOOP_H_
+
+#include <functional>
+#include <logging.h>
+#include <time.h>
+#include <unordered_map>
+
+#include "base_macros.h"
+#include "syscallhandler.h"
+
+namespace touch_keyboard {
+
+class EventLoop {
+ /* An epoll based loop that waits on any number of file descriptors and a
+  * single absolute deadline.
+  *
+  * Each watched file descriptor has a handler that is run whenever epoll
+  * reports it as readable.  On top of that the loop owns a timerfd on
+  * CLOCK_MONOTONIC that can be armed with an absolute deadline
+  * (TFD_TIMER_ABSTIME), so the timer handler runs as soon as that point in
+  * time has passed without any relative timeout arithmetic.  A deadline that
+  * is already in the past fires straight away.
+  *
+  * Call Init() once, register the file descriptors you're interested in with
+  * AddFd(), and then call Run() which blocks dispatching handlers until one of
+  * them calls Quit().
+  */
+ public:
+  // The timer handler is passed the deadline that the timer was armed with.
+  typedef std::function<void()> FdHandler;
+  typedef std::function<void(struct timespec const &deadline)> TimerHandler;
+
+  EventLoop() : syscall_handler_(&default_syscall_handler), epoll_fd_(-1),
+                timer_fd_(-1), timer_armed_(false), quit_(false) {}
+  explicit EventLoop(SyscallHandler *syscall_handler) :
+      syscall_handler_(syscall_handler), epoll_fd_(-1), timer_fd_(-1),
+      timer_armed_(false), quit_(false) {
+    if (syscall_handler_ == NULL) {
+      syscall_handler_ = &default_syscall_handler;
+    }
+  }
+
+  ~EventLoop();
+
+  // Create the epoll instance and the timerfd.  Returns false on failure.
+  bool Init();
+
+  // Start watching fd for input, running handler each time it is readable.
+  bool AddFd(int fd, FdHandler handler);
+
+  // Stop watching fd.
+  bool RemoveFd(int fd);
+
+  // Set the function to run when the deadline set by SetDeadline() expires.
+  void SetTimerHandler(TimerHandler handler) { timer_handler_ = handler; }
+
+  // Arm the timer for an absolute CLOCK_MONOTONIC deadline, replacing any
+  // previously armed one.  Re-arming with the same deadline is free.
+  bool SetDeadline(struct timespec const &deadline);
+
+  // Disarm the timer if it is armed.
+  bool ClearDeadline();
+
+  // Wait for and dispatch a single batch of ready file descriptors and timer
+  // expirations.
+  bool RunOnce();
+
+  // Loop dispatching handlers until Quit() is called.
+  void Run();
+
+  // Make Run() return once the handlers that are running are done.  This is
+  // meant to be called by a handler.
+  void Quit() { quit_ = true; }
+
+ private:
+  // The maximum number of ready file descriptors handled per epoll_wait().
+  static constexpr int kMaxEventsPerWait = 8;
+
+  // Called when the timerfd becomes readable.
+  void HandleTimerExpiry();
+
+  SyscallHandler *syscall_handler_;
+  int epoll_fd_;
+  int timer_fd_;
+
+  // The currently armed deadline, only meaningful if timer_armed_ is set.
+  bool timer_armed_;
+  struct timespec deadline_;
+
+  // Set by Quit().
+  bool quit_;
+
+  TimerHandler timer_handler_;
+  std::unordered_map<int, FdHandler> fd_handlers_;
+
+  DISALLOW_COPY_AND_ASSIGN(EventLoop);
+};
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_EVENTLOOP_H_
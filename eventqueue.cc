@@ -0,0 +1,108 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "eventqueue.h"
+
+namespace touch_keyboard {
+
+EventQueue::EventQueue() : next_sequence_(0) {
+  nodes_.reserve(kEventQueueCapacity);
+  free_nodes_.reserve(kEventQueueCapacity);
+  heap_.reserve(kEventQueueCapacity);
+}
+
+EventHandle EventQueue::Push(Event const &event) {
+  // Reuse a free node if there is one.  The pool only grows past its initial
+  // capacity if that many events are pending at once.
+  int node;
+  if (!free_nodes_.empty()) {
+    node = free_nodes_.back();
+    free_nodes_.pop_back();
+    nodes_[node].event_ = event;
+  } else {
+    node = nodes_.size();
+    nodes_.push_back(Node{event, 0, -1});
+  }
+  nodes_[node].sequence_ = next_sequence_++;
+
+  heap_.push_back(node);
+  nodes_[node].heap_index_ = heap_.size() - 1;
+  SiftUp(heap_.size() - 1);
+  return node;
+}
+
+void EventQueue::Pop() {
+  Remove(heap_[0]);
+}
+
+void EventQueue::Remove(EventHandle handle) {
+  int index = nodes_[handle].heap_index_;
+  nodes_[handle].heap_index_ = -1;
+  free_nodes_.push_back(handle);
+
+  // Fill the hole with the last node and restore the heap order around it.
+  int last = heap_.back();
+  heap_.pop_back();
+  if (index == static_cast<int>(heap_.size())) {
+    return;
+  }
+  Place(index, last);
+  if (index > 0 && Before(last, heap_[(index - 1) / 2])) {
+    SiftUp(index);
+  } else {
+    SiftDown(index);
+  }
+}
+
+bool EventQueue::Before(int a, int b) const {
+  struct timespec const &ta = nodes_[a].event_.deadline_;
+  struct timespec const &tb = nodes_[b].event_.deadline_;
+  if (ta.tv_sec != tb.tv_sec) {
+    return ta.tv_sec < tb.tv_sec;
+  }
+  if (ta.tv_nsec != tb.tv_nsec) {
+    return ta.tv_nsec < tb.tv_nsec;
+  }
+  return nodes_[a].sequence_ < nodes_[b].sequence_;
+}
+
+void EventQueue::SiftUp(int index) {
+  int node = heap_[index];
+  while (index > 0) {
+    int parent = (index - 1) / 2;
+    if (!Before(node, heap_[parent])) {
+      break;
+    }
+    Place(index, heap_[parent]);
+    index = parent;
+  }
+  Place(index, node);
+}
+
+void EventQueue::SiftDown(int index) {
+  int node = heap_[index];
+  int size = heap_.size();
+  while (true) {
+    int child = 2 * index + 1;
+    if (child >= size) {
+      break;
+    }
+    if (child + 1 < size && Before(heap_[child + 1], heap_[child])) {
+      child++;
+    }
+    if (!Before(heap_[child], node)) {
+      break;
+    }
+    Place(index, heap_[child]);
+    index = child;
+  }
+  Place(index, node);
+}
+
+void EventQueue::Place(int index, int node) {
+  heap_[index] = node;
+  nodes_[node].heap_index_ = index;
+}
+
+}  // namespace touch_keyboard
@@ -0,0 +1,143 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_EVENTQUEUE_H_
+#define TOUCH_KEYBOARD_EVENTQUEUE_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+#include "base_macros.h"
+
+namespace touch_keyboard {
+
+struct Event {
+ /* A class to represent a pending keyboard event that is scheduled to be
+  * generated by the fake keyboard.
+  *
+  * As keys are pressed by the user, the FakeKeyboard class generates keyboard
+  * events, which represent the keys being pressed and released.  To allow some
+  * measure of revoking, events are enqueued and only released after a brief
+  * pause.  This way, if something unexpected happens to invalidate a keypress,
+  * the system can simply not send it.  These events are represented as Event
+  * objects stored in a queue.  They store all the information you need about
+  * a keyboard event such as which keycode it is for, which direction the key
+  * is going, and when the deadline to release the event is.
+  */
+ public:
+  Event(int ev_code, bool is_down, struct timespec deadline, int tid) :
+    is_guaranteed_(false), is_repeat_(false), ev_code_(ev_code),
+    is_down_(is_down), tid_(tid), source_tid_(tid), deadline_(deadline) {}
+
+  // Some events are guaranteed to fire before their deadline expires.  For
+  // example, if a finger leaves before the deadline the system already knows
+  // everything about it and can make a decision right away.  Since there may
+  // be earlier, non-guaranteed events pending, we have to make such events
+  // guaranteed so that when they make it to the front of the queue, we know
+  // they are already checked and ready to go.
+  bool is_guaranteed_;
+
+  // Set for the autorepeat of a held key rather than a press or release.
+  // Repeats aren't queued, they go out at their deadline unless the finger
+  // holding the key lifts or is rejected first.
+  bool is_repeat_;
+
+  // This value stores which event code (which key) this event deals with.
+  int ev_code_;
+
+  // This value stores the "direction" of the event.  A value of true indicates
+  // that this is a key-down event whereas false indicates a key-up event.
+  bool is_down_;
+
+  // Here we store the tracking ID (tid) of the finger that triggered this
+  // event.  This is used to determine the validity of the event later, by
+  // looking up the finger's behavior via this tid.
+  int tid_;
+
+  // The tracking ID of the finger the event comes from.  Unlike tid_, this is
+  // kept for key-up events, whose tid_ is kOldTID so they aren't checked
+  // against a finger that may no longer be there.
+  int source_tid_;
+
+  // This timespec represents the deadline for this event to be emitted by.
+  // When an event is added to the queue a deadline is set briefly in the
+  // future.  When this deadline passes, the FakeKeyboard is forced to make a
+  // decision on whether or not the event is valid.
+  struct timespec deadline_;
+};
+
+// Identifies an event while it is in an EventQueue.
+typedef int EventHandle;
+constexpr EventHandle kNoEvent = -1;
+
+// The number of events an EventQueue has room for up front.  Each finger has
+// at most one pending key-down plus a key-up, so this is plenty.
+constexpr int kEventQueueCapacity = 128;
+
+class EventQueue {
+ /* The queue of pending keyboard events, ordered by deadline.
+  *
+  * This is a binary min-heap of deadlines over a preallocated pool of event
+  * nodes.  Events with the same deadline come out in the order they were
+  * pushed.  Push() returns a handle to the event, which stays valid until the
+  * event is popped or removed.  The handle can be used to modify the event
+  * with Get() or to take it out of the queue with Remove(), so looking up a
+  * single finger's event doesn't need a scan.  All operations are O(log n)
+  * or better and nothing is allocated unless more than kEventQueueCapacity
+  * events are pending at once.
+  */
+ public:
+  EventQueue();
+
+  bool empty() const { return heap_.empty(); }
+  int size() const { return heap_.size(); }
+
+  // The event with the earliest deadline.  The queue must not be empty.
+  Event const &Front() const { return nodes_[heap_[0]].event_; }
+
+  // Add an event to the queue and return its handle.
+  EventHandle Push(Event const &event);
+
+  // Remove the event returned by Front().
+  void Pop();
+
+  // The event behind handle.  Changing its deadline isn't allowed.
+  Event *Get(EventHandle handle) { return &nodes_[handle].event_; }
+
+  // Take the event behind handle out of the queue.
+  void Remove(EventHandle handle);
+
+ private:
+  struct Node {
+    Event event_;
+
+    // Breaks ties between equal deadlines, in the order events were pushed.
+    uint64_t sequence_;
+
+    // Where this node is in heap_, or -1 if it's free.
+    int heap_index_;
+  };
+
+  // True if node a has to come out before node b.
+  bool Before(int a, int b) const;
+
+  // Put heap_[index] back into heap order after it moved up or down.
+  void SiftUp(int index);
+  void SiftDown(int index);
+
+  // Store node at heap_[index] and update its position.
+  void Place(int index, int node);
+
+  std::vector<Node> nodes_;
+  std::vector<int> free_nodes_;
+  std::vector<int> heap_;
+  uint64_t next_sequence_;
+
+  DISALLOW_COPY_AND_ASSIGN(EventQueue);
+};
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_EVENTQUEUE_H_
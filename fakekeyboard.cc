@@ -4,8 +4,7 @@
 
 #include "fakekeyboard.h"
 
-#define CSV_IO_NO_THREAD
-#include "csv.h"
+#include <sys/inotify.h>
 
 namespace touch_keyboard {
 
@@ -14,190 +13,341 @@ namespace touch_keyboard {
 // has less time to confirm keypresses and may increase the error rate.
 constexpr int kEventDelayMS = 50;
 
+// With an adaptive delay, its state is saved after this many touches.
+constexpr uint64_t kDebounceSaveInterval = 100;
+
 // These dummy values are used to track events.
 constexpr bool kKeyDownEvent = true;
 constexpr bool kKeyUpEvent = false;
+
+// The value of an EV_KEY event that repeats a held key.
+constexpr int kKeyRepeatValue = 2;
 constexpr int kNoKey = -1;
 constexpr int kOldTID = -999;
 
-constexpr int kMinTapPressure = 50;
-constexpr int kMaxTapPressure = 110;
-
-constexpr int kMinTapTouchDiameter = 300;
-constexpr int kMaxTapTouchDiameter = 3000;
+// Every this many events sent early, the latency saved so far is logged.
+constexpr uint64_t kCommitStatsLogInterval = 1000;
+
+// Split path into the directory it's in and the name of the file.
+static void SplitPath(std::string const &path, std::string *dir,
+                      std::string *name) {
+  size_t slash = path.find_last_of('/');
+  if (slash == std::string::npos) {
+    *dir = ".";
+    *name = path;
+  } else {
+    *dir = slash == 0 ? "/" : path.substr(0, slash);
+    *name = path.substr(slash + 1);
+  }
+}
 
 FakeKeyboard::FakeKeyboard(struct hw_config &hw_config,
-    TouchFFManager &ffManager) :
-  hw_config_(hw_config) {
+    TouchFFManager &ffManager, FrameQueue *frames,
+    SyscallHandler *syscall_handler, Clock *clock) :
+  UinputDevice(syscall_handler),
+  clock_(clock == NULL ? &default_clock : clock), layout_index_(0),
+  requested_layout_(kNoLayoutRequest), stop_fd_(-1), inotify_fd_(-1),
+  max_key_delay_ms_(0),
+  frames_(frames), hw_config_(hw_config),
+  commit_policy_(CommitPolicy::kDeadline), commit_stats_({0, 0}),
+  event_delay_ms_(kEventDelayMS), last_deadline_({0, 0}),
+  adaptive_delay_(false),
+  debounce_(kEventDelayMS, kDefaultMinDebounceMS, kDefaultMaxDebounceMS),
+  repeat_delay_ms_(0), repeat_period_ms_(0), repeating_(false),
+  repeat_(KEY_RESERVED, kKeyDownEvent, {0, 0}, kOldTID),
+  rollover_(false), key_holders_(KEY_CNT, kNoHolder), gap_distance_mm_(0) {
+
+  if (!AddLayout("layout.csv"))
+    throw "Failed to load the keyboard layout";
+  layout_ = layouts_[0];
 
-  fn_key_pressed_ = false;
+  ff_manager_ = &ffManager;
 
-  LoadLayout("layout.csv");
+  // A stop can be requested before Start() is even called.
+  stop_fd_ = this->syscall_handler()->eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (stop_fd_ < 0)
+    throw "Failed to create the keyboard's stop eventfd";
+}
 
-  ff_manager_ = &ffManager;
+FakeKeyboard::~FakeKeyboard() {
+  if (inotify_fd_ >= 0) {
+    syscall_handler()->close(inotify_fd_);
+  }
+  if (stop_fd_ >= 0) {
+    syscall_handler()->close(stop_fd_);
+  }
+}
 
+bool FakeKeyboard::AddLayout(std::string const &path) {
+  std::shared_ptr<Layout const> layout = Layout::Load(path, hw_config_);
+  if (!layout) {
+    return false;
+  }
+  max_key_delay_ms_ = std::max(max_key_delay_ms_, layout->max_key_delay_ms());
+  layouts_.push_back(layout);
+  return true;
 }
 
-bool FakeKeyboard::LoadLayout(std::string const &layout_filename) {
-  double hw_pitch_x, hw_pitch_y;
-
-  hw_pitch_x = hw_config_.res_x / hw_config_.width_mm;
-  hw_pitch_y = hw_config_.res_y / hw_config_.height_mm;
-
-  LOG(DEBUG) << "pitch: " << hw_pitch_x << "x" << hw_pitch_y << "\n";
-
-  io::CSVReader<8,
-    io::trim_chars<' ', '\t'>,
-    io::no_quote_escape<';'>> l_csv(layout_filename);
-
-  l_csv.read_header(io::ignore_missing_column, "x", "y", "width", "height",
-      "name", "code", "name_fn", "code_fn");
-
-  double x, y, w, h;
-  double left_margin, top_margin;
-  std::string keyname;
-  std::string keyname_fn = "";
-  int keycode = 0;
-  int keycode_fn = 0;
-
-  left_margin = hw_config_.left_margin_mm;
-  top_margin = hw_config_.top_margin_mm;
-
-  while(l_csv.read_row(x, y, w, h, keyname, keycode, keyname_fn, keycode_fn)) {
-    LOG(DEBUG) << "Key " << keyname << "(" << keycode << ") | " <<
-      keyname_fn << " (" << keycode_fn << "): " <<
-      w << "x" << h << "@(" << x << "," << y << ") mm\n";
-
-    int x1 = 0, x2 = 0, y1 = 0, y2 = 0;
-
-    switch (hw_config_.rotation) {
-      case 0:
-        x1 = (left_margin + x) * hw_pitch_x;
-        x2 = (left_margin + x + w) * hw_pitch_x;
-        y1 = (top_margin + y) * hw_pitch_y;
-        y2 = (top_margin + y + h) * hw_pitch_y;
-        break;
-      case 90:
-        x1 = (top_margin + y) * hw_pitch_x;
-        x2 = (top_margin + y + h) * hw_pitch_x;
-        y1 = (hw_config_.height_mm - (left_margin + x + w)) * hw_pitch_y;
-        y2 = (hw_config_.height_mm - (left_margin + x)) * hw_pitch_y;
-        break;
-      case 180:
-        x1 = (hw_config_.width_mm - (left_margin + x + w)) * hw_pitch_x;
-        x1 = (hw_config_.width_mm - (left_margin + x)) * hw_pitch_x;
-        y1 = (hw_config_.height_mm - (top_margin + y + h)) * hw_pitch_y;
-        y2 = (hw_config_.height_mm - (top_margin + y)) * hw_pitch_y;
-        break;
-      case 270:
-        x1 = (hw_config_.width_mm - (y + h + top_margin)) * hw_pitch_x;
-        x2 = (hw_config_.width_mm - (y + top_margin)) * hw_pitch_x;
-        y1 = (left_margin + x) * hw_pitch_y;
-        y2 = (left_margin + x + w) * hw_pitch_y;
-        break;
-      default:
-        LOG(ERROR) << "Rotation by " << hw_config_.rotation << " degrees is not supported\n";
-        return false;
+void FakeKeyboard::EnableKeyboardEvents() {
+  // Enable key events in general for output.  EV_REP is left out on
+  // purpose, with it the kernel would repeat held keys on its own as well.
+  EnableEventType(EV_KEY);
+  // Enable each specific key code found in any layer of any of the layouts.
+  for (auto const &layout : layouts_) {
+    for (KeyBinding const &binding : layout->bindings()) {
+      int code = binding.code_;
+      if (code > 0 && code < KEY_CNT && !enabled_codes_.test(code)) {
+        EnableKeyEvent(code);
+        enabled_codes_.set(code);
+      }
     }
+  }
+}
 
-    LOG(DEBUG) << "HW coords: (" << x1 << ", " << y1 << "), (" <<
-      x2 << ", " << y2 << ")\n";
+void FakeKeyboard::ApplyLayoutRequest() {
+  int request = requested_layout_.exchange(kNoLayoutRequest);
+  if (request == kNextLayoutRequest) {
+    SelectLayout((layout_index_ + 1) % layouts_.size());
+  } else if (request != kNoLayoutRequest) {
+    SelectLayout(request);
+  }
+}
 
-    layout_.push_back(Key(keycode, keycode_fn, x1, x2, y1, y2));
+void FakeKeyboard::SelectLayout(int index) {
+  if (index < 0 || index >= static_cast<int>(layouts_.size())) {
+    LOG(WARNING) << "There is no layout " << index << "\n";
+    return;
   }
+  // Only new fingers use the new layout, each finger that is already down
+  // holds on to the one it started on.
+  layout_index_ = index;
+  layout_ = layouts_[index];
+  LOG(INFO) << "Switched to the layout " << layout_->path() << "\n";
+}
 
-  return true;
+void FakeKeyboard::WatchLayouts() {
+  inotify_fd_ = syscall_handler()->inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd_ < 0) {
+    PLOG(WARNING) << "Unable to watch the layouts for changes\n";
+    return;
+  }
+  // Editors tend to replace files rather than write them in place, so the
+  // directories are watched rather than the files themselves.
+  for (auto const &layout : layouts_) {
+    std::string dir, name;
+    SplitPath(layout->path(), &dir, &name);
+    int wd = syscall_handler()->inotify_add_watch(inotify_fd_, dir.c_str(),
+                                                  IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0) {
+      PLOG(WARNING) << "Unable to watch " << dir << " for changes\n";
+      continue;
+    }
+    watched_dirs_[wd] = dir;
+  }
+  loop_.AddFd(inotify_fd_, [this]() { HandleLayoutChanges(); });
 }
 
-void FakeKeyboard::EnableKeyboardEvents() const {
-  // Enable key events in general for output.
-  EnableEventType(EV_KEY);
-  // Enable each specific key code found in the layout.
-  for (unsigned int i = 0; i < layout_.size(); i++) {
-    EnableKeyEvent(layout_[i].event_code_);
-    if (layout_[i].event_code_fn_)
-      EnableKeyEvent(layout_[i].event_code_fn_);
+void FakeKeyboard::HandleLayoutChanges() {
+  alignas(struct inotify_event) char buffer[4096];
+  ssize_t size;
+  while ((size = syscall_handler()->read(inotify_fd_, buffer,
+                                         sizeof(buffer))) > 0) {
+    for (char *p = buffer; p < buffer + size;) {
+      struct inotify_event const *event =
+          reinterpret_cast<struct inotify_event const *>(p);
+      p += sizeof(struct inotify_event) + event->len;
+
+      auto dir = watched_dirs_.find(event->wd);
+      if (dir == watched_dirs_.end() || event->len == 0) {
+        continue;
+      }
+      for (unsigned int i = 0; i < layouts_.size(); i++) {
+        std::string layout_dir, layout_name;
+        SplitPath(layouts_[i]->path(), &layout_dir, &layout_name);
+        if (layout_name == event->name && layout_dir == dir->second) {
+          ReloadLayout(i);
+        }
+      }
+    }
   }
 }
 
-struct timespec FakeKeyboard::AddMsToTimespec(struct timespec const& orig,
-                                              int additional_ms) {
-  struct timespec extended = orig;
-  extended.tv_nsec += additional_ms * 1e6;
-  while (extended.tv_nsec >= 1e9) {
-    extended.tv_nsec -= 1e9;
-    extended.tv_sec += 1;
+void FakeKeyboard::ReloadLayout(int index) {
+  std::shared_ptr<Layout const> layout =
+      Layout::Load(layouts_[index]->path(), hw_config_);
+  if (!layout) {
+    LOG(WARNING) << "Keeping the previous version of the layout\n";
+    return;
+  }
+  for (KeyBinding const &binding : layout->bindings()) {
+    int code = binding.code_;
+    if (code > 0 && code < KEY_CNT && !enabled_codes_.test(code)) {
+      LOG(WARNING) << "Key code " << code << " is new, it can't be sent " <<
+                      "until touch_keyboard_handler is restarted\n";
+    }
+  }
+  max_key_delay_ms_ = std::max(max_key_delay_ms_, layout->max_key_delay_ms());
+  layouts_[index] = layout;
+  if (index == layout_index_) {
+    layout_ = layout;
   }
-  return extended;
 }
 
-bool FakeKeyboard::TimespecIsLater(struct timespec const& t1,
-                                    struct timespec const& t2) {
-  return ((t1.tv_sec > t2.tv_sec) ||
-          (t1.tv_sec == t2.tv_sec && t1.tv_nsec > t2.tv_nsec));
+struct timespec FakeKeyboard::NextDeadline(struct timespec now,
+                                           int delay_ms) {
+  // A deadline further out than any delay can only be left over from before
+  // the clock jumped back, and is ignored.
+  int max_delay_ms = std::max(debounce_.max_ms(), max_key_delay_ms_);
+  struct timespec deadline = AddMsToTimespec(now, delay_ms);
+  if (TimespecIsLater(last_deadline_, deadline) &&
+      !TimespecIsLater(last_deadline_, AddMsToTimespec(now, max_delay_ms))) {
+    deadline = last_deadline_;
+  }
+  last_deadline_ = deadline;
+  return deadline;
 }
 
-int FakeKeyboard::GenerateEventForArrivingFinger(
-    struct timespec now,
-    struct mtstatemachine::MtFinger const &finger, int tid, int *event_code) {
+void FakeKeyboard::SetAdaptiveDelay(std::string const &state_path,
+                                    int min_ms, int max_ms) {
+  adaptive_delay_ = true;
+  debounce_state_path_ = state_path;
+  debounce_ = DebounceEstimator(kEventDelayMS, min_ms, max_ms);
+  debounce_.Load(state_path);
+  event_delay_ms_ = debounce_.DelayMS();
+}
 
-  for (unsigned int key_num = 0; key_num < layout_.size(); key_num++) {
-    if (layout_[key_num].Contains(finger.x, finger.y)) {
+void FakeKeyboard::SaveDebounceState() const {
+  if (adaptive_delay_) {
+    debounce_.LogState();
+    debounce_.Save(debounce_state_path_);
+  }
+}
 
-      if (fn_key_pressed_ && layout_[key_num].event_code_fn_)
-        *event_code = layout_[key_num].event_code_fn_;
-      else
-        *event_code = layout_[key_num].event_code_;
+void FakeKeyboard::RecordTouchOutcome(FingerData const &data, bool rejected,
+                                      struct timespec now) {
+  if (!adaptive_delay_) {
+    return;
+  }
+  int elapsed_ms = MsBetween(data.arrival_time_, now);
+  if (rejected) {
+    debounce_.AddRejection(elapsed_ms);
+  } else {
+    debounce_.AddTap(elapsed_ms);
+  }
 
-      LOG(DEBUG) << "fn_key_pressed_: " << fn_key_pressed_ << ", event_code: " <<
-        *event_code << "\n";
+  if (debounce_.DelayMS() != event_delay_ms_) {
+    LOG(DEBUG) << "Debounce delay is now " << debounce_.DelayMS() << " ms\n";
+    event_delay_ms_ = debounce_.DelayMS();
+  }
+  if (debounce_.observations() % kDebounceSaveInterval == 0) {
+    SaveDebounceState();
+  }
+}
 
-      Event ev(*event_code, kKeyDownEvent,
-               AddMsToTimespec(now, kEventDelayMS), tid);
-      EnqueueEvent(ev);
-      return key_num;
+int FakeKeyboard::GenerateEventForArrivingFinger(
+    struct timespec now,
+    struct mtstatemachine::MtFinger const &finger, int tid,
+    KeyBinding *binding, EventHandle *handle, double *confidence) {
+
+  *handle = kNoEvent;
+  *confidence = 1;
+  int key_num = layout_->Find(finger.x, finger.y);
+  if (key_num < 0 && gap_distance_mm_ > 0) {
+    key_num = layout_->FindNearest(finger.x, finger.y, gap_distance_mm_,
+                                   confidence);
+    if (key_num >= 0) {
+      LOG(DEBUG) << "Touch between keys given to key " << key_num <<
+                    " with confidence " << *confidence << "\n";
     }
   }
-  return kNoKey;
+  if (key_num < 0) {
+    return kNoKey;
+  }
+
+  *binding = layout_->binding(layers_.active(), key_num);
+
+  LOG(DEBUG) << "layer: " << layers_.active() << ", event_code: " <<
+    binding->code_ << "\n";
+
+  Event ev(binding->code_, kKeyDownEvent,
+           NextDeadline(now, KeyDelayMS(*layout_, key_num)), tid);
+  *handle = EnqueueEvent(ev);
+  return key_num;
 }
 
-void FakeKeyboard::HandleLeavingFinger(int tid, FingerData finger,
+void FakeKeyboard::HandleLeavingFinger(int tid, FingerData const &finger,
                                        timespec now) {
   bool up_event_guaranteed = false, down_event_guaranteed = false;
 
+  // A layer the finger was holding is released as it lifts, whatever becomes
+  // of its own events.
+  ReleaseLayer(&finger_data_[tid]);
+
   // If the finger has already been marked dead for some reason, ignore it.
   if (finger.rejection_status_ != RejectionStatus::kNotRejectedYet) {
     return;
   }
 
+  // Its key stops repeating right away rather than when the up event is sent.
+  StopRepeatForFinger(tid);
+
+  // When committing early the tap is checked now, so its events can go out
+  // without waiting for the deadline.  A tap that fails the check never sent
+  // its down event and doesn't need an up event either.
+  if (commit_policy_ == CommitPolicy::kEarly && !finger.down_sent_ &&
+      finger.pending_event_ != kNoEvent && !TapIsValid(finger)) {
+    LogTouchOutcome(finger, "rejected, invalid tap");
+    RecordTouchOutcome(finger, true, now);
+    pending_events_.Remove(finger.pending_event_);
+    return;
+  }
+
+  RecordTouchOutcome(finger, false, now);
+
   // If there is an outstanding down event for this finger and mark it
   // guaranteed.
-  if (!finger.down_sent_) {
-    std::list<Event>::iterator it = pending_events_.begin();
-    while (it != pending_events_.end()) {
-      if (it->tid_ == tid) {
-        it->is_guaranteed_ = true;
-        down_event_guaranteed |= it->is_down_;
-        up_event_guaranteed |= !it->is_down_;
-        break;
-      }
-      it++;
-    }
+  if (!finger.down_sent_ && finger.pending_event_ != kNoEvent) {
+    LogTouchOutcome(finger, "committed");
+    Event *ev = pending_events_.Get(finger.pending_event_);
+    ev->is_guaranteed_ = true;
+    down_event_guaranteed |= ev->is_down_;
+    up_event_guaranteed |= !ev->is_down_;
   }
 
   // If we're here we either have already sent the key_down event for this
   // finger, or have just marked in guaranteed.  Either way we have to enqueue
   // a guaranteed up event now if there isn't one already.
   if (!up_event_guaranteed) {
-    EnqueueKeyUpEvent(finger.event_code_, now);
-    if (finger.event_code_ == KEY_FN)
-      fn_key_pressed_ = false;
+    EnqueueKeyUpEvent(tid, finger, now);
+  }
+}
+
+void FakeKeyboard::LogTouchOutcome(FingerData const &data,
+                                   std::string const &outcome) const {
+  if (data.key_confidence_ < 1) {
+    LOG(INFO) << "Touch given to key " << data.starting_key_number_ <<
+                 " with confidence " << data.key_confidence_ << ": " <<
+                 outcome << "\n";
+  } else {
+    LOG(DEBUG) << "Touch on key " << data.starting_key_number_ << ": " <<
+                  outcome << "\n";
+  }
+}
+
+void FakeKeyboard::ReleaseLayer(FingerData *data) {
+  if (data->held_layer_) {
+    layers_.Release(data->held_layer_);
+    data->held_layer_ = 0;
   }
 }
 
-void FakeKeyboard::EnqueueKeyUpEvent(int ev_code, timespec now) {
-  Event up_event(ev_code, kKeyUpEvent,
-                 AddMsToTimespec(now, kEventDelayMS), kOldTID);
+void FakeKeyboard::EnqueueKeyUpEvent(int tid, FingerData const &finger,
+                                     timespec now) {
+  Event up_event(finger.event_code_, kKeyUpEvent,
+                 NextDeadline(now, KeyDelayMS(*finger.layout_,
+                                              finger.starting_key_number_)),
+                 kOldTID);
+  up_event.source_tid_ = tid;
   up_event.is_guaranteed_ = true;
   EnqueueEvent(up_event);
 }
@@ -211,55 +361,142 @@ bool FakeKeyboard::StillOnFirstKey(
   }
 
   // Otherwise, see if it's still contained in that starting key.
-  return layout_.at(data.starting_key_number_).Contains(finger.x, finger.y);
+  Layout const &layout = *data.layout_;
+  if (layout.key(data.starting_key_number_).Contains(finger.x, finger.y)) {
+    return true;
+  }
+
+  // The gaps around the key count as part of it if they are resolved to it.
+  double confidence;
+  return gap_distance_mm_ > 0 && layout.Find(finger.x, finger.y) < 0 &&
+         layout.FindNearest(finger.x, finger.y, gap_distance_mm_,
+                            &confidence) == data.starting_key_number_;
 }
 
 void FakeKeyboard::RejectFinger(int tid, RejectionStatus reason) {
-  LOG(DEBUG) << "Reject finger, reason " << static_cast<int>(reason) << "\n";
   // First, mark the finger's FingerData as rejected.
-  finger_data_[tid].rejection_status_ = reason;
-
-  // Next, scan through the pending events and delete any for that finger.
-  std::list<Event>::iterator it = pending_events_.begin();
-  while (it != pending_events_.end()) {
-    auto current = it++;
-    if (current->tid_ == tid) {
-      pending_events_.erase(current);
+  FingerData &data = finger_data_[tid];
+  LogTouchOutcome(data, "rejected, reason " +
+                        std::to_string(static_cast<int>(reason)));
+  data.rejection_status_ = reason;
+  ReleaseLayer(&data);
+
+  // Next, delete the pending event for that finger, if it has one.
+  if (data.pending_event_ != kNoEvent) {
+    pending_events_.Remove(data.pending_event_);
+    data.pending_event_ = kNoEvent;
+  }
+
+  // A rejected finger doesn't get to repeat its key either.
+  StopRepeatForFinger(tid);
+}
+
+void FakeKeyboard::SetAutorepeat(int delay_ms, int period_ms) {
+  repeat_delay_ms_ = delay_ms;
+  repeat_period_ms_ = std::max(period_ms, 1);
+}
+
+void FakeKeyboard::StartRepeat(int ev_code, int tid,
+                               struct timespec deadline) {
+  repeat_ = Event(ev_code, kKeyDownEvent, deadline, tid);
+  repeat_.is_repeat_ = true;
+  repeating_ = true;
+}
+
+void FakeKeyboard::StopRepeat() {
+  repeating_ = false;
+}
+
+void FakeKeyboard::StopRepeatForFinger(int tid) {
+  if (repeating_ && repeat_.tid_ == tid) {
+    StopRepeat();
+  }
+}
+
+void FakeKeyboard::HandleResync(
+    struct timespec now,
+    mtstatemachine::MtSnapshot const &snapshot) {
+  // Any finger that disappeared while events were being dropped may have
+  // done anything in the meantime, so rather than guessing we reject its
+  // pending events and release its key if it was already pressed.  Fingers
+  // that are still down are checked as usual by ProcessIncomingSnapshot().
+  std::unordered_map<int, FingerData>::iterator data_it = finger_data_.begin();
+  while (data_it != finger_data_.end()) {
+    int tid = data_it->first;
+    if (tid == kOldTID || snapshot.FindByTrackingID(tid) != NULL) {
+      data_it++;
+      continue;
+    }
+
+    if (data_it->second.rejection_status_ ==
+        RejectionStatus::kNotRejectedYet && data_it->second.down_sent_) {
+      EnqueueKeyUpEvent(tid, data_it->second, now);
     }
+    RejectFinger(tid, RejectionStatus::kRejectEventsDropped);
+    data_it = finger_data_.erase(data_it);
   }
 }
 
 void FakeKeyboard::ProcessIncomingSnapshot(
     struct timespec now,
-    std::unordered_map<int, struct mtstatemachine::MtFinger> const &snapshot) {
+    mtstatemachine::MtFrame const &frame) {
+  mtstatemachine::MtSnapshot const &snapshot = frame.snapshot_;
+
   // First we go through all the touches reported by the touchscreen in the most
-  // recent snapshot.
-  for (auto map_entry : snapshot) {
-    int tid = map_entry.first;
-    struct mtstatemachine::MtFinger finger = map_entry.second;
+  // recent snapshot.  A contact whose slot didn't change has nothing new to
+  // look at, unless it turned out to be a palm.
+  for (auto const &contact : snapshot) {
+    bool palm = (frame.palm_slots_ >> contact.slot) & 1;
+    if (!palm && !((frame.changed_slots_ >> contact.slot) & 1)) {
+      continue;
+    }
+    int tid = contact.tid;
+    struct mtstatemachine::MtFinger const &finger = contact.finger;
 
     std::unordered_map<int, FingerData>::iterator data_for_tid_it;
     data_for_tid_it = finger_data_.find(tid);
     if (data_for_tid_it == finger_data_.end()) {
-      int event_code = 0;
-      int key = GenerateEventForArrivingFinger(now, finger, tid, &event_code);
+      // A palm doesn't press anything, it's only tracked until it lifts.
+      KeyBinding binding = {0, LayerRule::kNone, 0};
+      EventHandle handle = kNoEvent;
+      double confidence = 1;
+      int key = kNoKey;
+      if (!palm) {
+        key = GenerateEventForArrivingFinger(now, finger, tid, &binding,
+                                             &handle, &confidence);
+      }
 
       // If this is a newly arriving finger, make a new entry for it and fill
       // out all the starting data we have.  In some cases, this may invalidate
       // a finger immediately.
       FingerData data;
       data.arrival_time_ = now;
+      data.layout_ = layout_;
       data.max_pressure_ = finger.p;
       data.max_touch_major_ = finger.touch_major;
       data.starting_key_number_ = key;
-      data.event_code_ = event_code;
+      data.key_confidence_ = confidence;
+      data.pending_event_ = handle;
+      data.event_code_ = binding.code_;
+      data.held_layer_ = 0;
       data.down_sent_ = false;
       data.rejection_status_ = RejectionStatus::kNotRejectedYet;
 
-      if (event_code == KEY_FN)
-        fn_key_pressed_ = true;
+      // A held layer is switched on as soon as its key is touched, so keys
+      // touched together with it already use it.  Any other key uses up the
+      // one-shot layers.
+      if (key != kNoKey) {
+        if (binding.rule_ == LayerRule::kHold) {
+          layers_.Hold(binding.layer_);
+          data.held_layer_ = binding.layer_;
+        } else if (binding.rule_ == LayerRule::kNone) {
+          layers_.ConsumeOneShots();
+        }
+      }
 
-      if (key == kNoKey) {
+      if (palm) {
+        data.rejection_status_ = RejectionStatus::kRejectPalm;
+      } else if (key == kNoKey) {
         data.rejection_status_ = RejectionStatus::kRejectTouchdownOffKey;
       } else {
         ff_manager_->EventTriggered(TouchKeyboardEvent::FingerDown, finger.x, finger.y);
@@ -268,6 +505,15 @@ void FakeKeyboard::ProcessIncomingSnapshot(
       // TODO(charliemooney): Add more data here that can be used for
       // tracking fingers.
       finger_data_[tid] = data;
+    } else if (palm && data_for_tid_it->second.rejection_status_ ==
+                       RejectionStatus::kNotRejectedYet) {
+      // A finger that turned out to be a palm is dropped, releasing its key
+      // if it was already pressed.  This isn't a tap gone wrong, so the
+      // debounce delay doesn't learn from it.
+      RejectFinger(tid, RejectionStatus::kRejectPalm);
+      if (data_for_tid_it->second.down_sent_) {
+        EnqueueKeyUpEvent(tid, data_for_tid_it->second, now);
+      }
     } else if (data_for_tid_it->second.rejection_status_ ==
                RejectionStatus::kNotRejectedYet) {
       // If we've seen this finger before, update the data on it.
@@ -281,15 +527,13 @@ void FakeKeyboard::ProcessIncomingSnapshot(
 
       // Check if the finger has left the key it started on
       if (!StillOnFirstKey(finger, data_for_tid_it->second)) {
+        RecordTouchOutcome(data_for_tid_it->second, true, now);
         RejectFinger(data_for_tid_it->first,
                      RejectionStatus::kRejectMovedOffKey);
         if (data_for_tid_it->second.down_sent_) {
           // Send a KeyUp event to cancel any held-down buttons.
-          EnqueueKeyUpEvent(
-              data_for_tid_it->second.event_code_, now);
-
-          if (data_for_tid_it->second.event_code_ == KEY_FN)
-            fn_key_pressed_ = false;
+          EnqueueKeyUpEvent(data_for_tid_it->first, data_for_tid_it->second,
+                            now);
         }
       }
 
@@ -298,13 +542,16 @@ void FakeKeyboard::ProcessIncomingSnapshot(
   }
 
   // Next we need to check if there are any fingers missing that we saw before
-  // which would indicate a finger leaving the touchscreen.
+  // which would indicate a finger leaving the touchscreen.  That can only be
+  // the case if a contact ended in this frame.
+  if (frame.ended_slots_ == 0) {
+    return;
+  }
   std::unordered_map<int, FingerData>::iterator data_it = finger_data_.begin();
   while (data_it != finger_data_.end()) {
     int tid = data_it->first;
     FingerData this_finger_data = data_it->second;
-    auto input_it = snapshot.find(tid);
-    if (tid != kOldTID && input_it == snapshot.end()) {
+    if (tid != kOldTID && snapshot.FindByTrackingID(tid) == NULL) {
       HandleLeavingFinger(tid, this_finger_data, now);
       auto next = data_it;
       next++;
@@ -316,146 +563,362 @@ void FakeKeyboard::ProcessIncomingSnapshot(
   }
 }
 
-void FakeKeyboard::EnqueueEvent(Event ev) {
-  // Find the right place in the queue, maintaining the order.
-  std::list<Event>::iterator it = pending_events_.begin();
-  while (it != pending_events_.end()) {
-    if (TimespecIsLater(it->deadline_, ev.deadline_)) {
-      pending_events_.insert(it, ev);
-      return;
+EventHandle FakeKeyboard::EnqueueEvent(Event const &ev) {
+  // The queue keeps the order, events with the same deadline stay in the
+  // order they were enqueued.
+  return pending_events_.Push(ev);
+}
+
+void FakeKeyboard::HandleFramesReady() {
+  frames_->ClearNotification();
+  ProcessQueuedFrames();
+  UpdateDeadline();
+}
+
+void FakeKeyboard::ProcessQueuedFrames() {
+  // Process every frame the decoder has queued, enqueueing events as needed.
+  // Before each frame, anything that came due before the sensor sampled it is
+  // sent, so the order is the same however late the frame is handled.
+  mtstatemachine::MtFrame const *frame;
+  while ((frame = frames_->Front()) != NULL) {
+    ApplyLayoutRequest();
+
+    // Everything about this frame happened when the sensor sampled it, so its
+    // timestamp is used as the current time rather than when it got here.
+    struct timespec now = frame->time_;
+    AdvanceTo(now);
+    if (frame->resynced_) {
+      HandleResync(now, frame->snapshot_);
     }
-    it++;
+    ProcessIncomingSnapshot(now, *frame);
+    frames_->Pop();
+    AdvanceTo(now);
   }
+}
 
-  // If we didn't find a place for it, then it must belong at the end.
-  pending_events_.push_back(ev);
+void FakeKeyboard::FlushPendingEvents() {
+  // No more frames are coming, so nothing would ever stop a held key from
+  // repeating.
+  while (!pending_events_.empty()) {
+    StopRepeat();
+    struct timespec deadline = pending_events_.Front().deadline_;
+    clock_->WaitUntil(deadline);
+    AdvanceTo(deadline);
+  }
 }
 
-void FakeKeyboard::Consume() {
-  while (1) {
-    bool needs_syn = false;
-
-    // Compute how long to wait for a timeout. (At most until the next pending
-    // event is set to fire)
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    int timeout_ms = -1;  // No timeout if there aren't any pending events.
-    if (!pending_events_.empty()) {
-      timespec deadline = pending_events_.front().deadline_;
-      timeout_ms = ((deadline.tv_sec - now.tv_sec) * 1000 +
-                    (deadline.tv_nsec - now.tv_nsec) / 1000000);
-      timeout_ms++;  // Always add 1 more ms so as to not undershoot.
-      if (timeout_ms < 0) {
-        LOG(WARNING) << "Negative timeout (" << timeout_ms <<
-                        ").  We missed an event somewhere!\n";
-        timeout_ms = 1;
-      }
+void FakeKeyboard::AdvanceTo(struct timespec time) {
+  struct timespec deadline;
+  while (FirstReadyDeadline(time, &deadline)) {
+    // Events committed early go out at time, everything else at its deadline.
+    FireReadyEvents(TimespecIsLater(deadline, time) ? time : deadline);
+  }
+}
+
+bool FakeKeyboard::FirstReadyDeadline(struct timespec time,
+                                      struct timespec *deadline) const {
+  bool ready = false;
+  if (!pending_events_.empty() && IsReady(pending_events_.Front(), time)) {
+    *deadline = pending_events_.Front().deadline_;
+    ready = true;
+  }
+  if (repeating_ && !TimespecIsLater(repeat_.deadline_, time) &&
+      (!ready || !TimespecIsLater(repeat_.deadline_, *deadline))) {
+    *deadline = repeat_.deadline_;
+    ready = true;
+  }
+  return ready;
+}
+
+bool FakeKeyboard::IsReady(Event const &ev, struct timespec now) const {
+  if (!TimespecIsLater(ev.deadline_, now)) {
+    return true;
+  }
+  // A guaranteed event is certain to be sent, so the early policy doesn't
+  // wait for its deadline.  Events queued behind an undecided one still have
+  // to wait for it, which keeps everything in order.  Repeats are about
+  // timing, so they always wait.
+  return commit_policy_ == CommitPolicy::kEarly && ev.is_guaranteed_ &&
+         !ev.is_repeat_;
+}
+
+bool FakeKeyboard::TapIsValid(FingerData const &data) const {
+  // Currently there is only a pressure check here, but more could easily be
+  // added later.
+  KeyParams const &params = data.layout_->params(data.starting_key_number_);
+  if (data.max_pressure_ != -1) {
+    // This checks if the maximum pressure a finger reported is within
+    // range.
+    if (data.max_pressure_ < params.min_pressure_ ||
+        data.max_pressure_ > params.max_pressure_) {
+      LOG(INFO) << "Tap rejected!  Pressure of " <<
+        data.max_pressure_ << " is out of range " <<
+        params.min_pressure_ << "->" << params.max_pressure_ << "\n";
+      return false;
+    }
+  } else {
+    if (data.max_touch_major_ < params.min_touch_major_ ||
+        data.max_touch_major_ > params.max_touch_major_) {
+      LOG(INFO) << "Tap rejected!  Diameter of " <<
+        data.max_touch_major_ << " is out of range " <<
+        params.min_touch_major_ << "->" << params.max_touch_major_ << "\n";
+      return false;
     }
+  }
+  return true;
+}
+
+int FakeKeyboard::KeyDelayMS(Layout const &layout, int key_num) const {
+  if (key_num == kNoKey || !layout.params(key_num).delay_ms_) {
+    return event_delay_ms_;
+  }
+  return layout.params(key_num).delay_ms_;
+}
+
+void FakeKeyboard::LogCommitStats() const {
+  if (commit_stats_.early_events_ == 0) {
+    return;
+  }
+  LOG(INFO) << commit_stats_.early_events_ << " events sent early, " <<
+               "saving " << commit_stats_.saved_ns_ / 1000000 << " ms (" <<
+               commit_stats_.saved_ns_ / commit_stats_.early_events_ / 1000 <<
+               " us per event).\n";
+}
 
-    // Wait for a touchscreen event or a timeout.  If there's an event from
-    // the touchscreen add it to the statemachine.  Otherwise, that means it's
-    // time to fire the next pending event.
-    struct input_event ev;
-    bool event_ready = GetNextEvent(timeout_ms, &ev);
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    if (event_ready) {
-      std::unordered_map<int, struct mtstatemachine::MtFinger> snapshot;
-      if (sm_.AddEvent(ev, &snapshot)) {
-        // Here we process the new snapshot, enqueing events as needed.
-        ProcessIncomingSnapshot(now, snapshot);
+void FakeKeyboard::UpdateDeadline() {
+  // Arm the event loop's timer for the head of the queue or the key repeat,
+  // or disarm it if there is nothing left to wait for.
+  if (pending_events_.empty() && !repeating_) {
+    loop_.ClearDeadline();
+  } else if (pending_events_.empty() ||
+             (repeating_ && TimespecIsLater(pending_events_.Front().deadline_,
+                                            repeat_.deadline_))) {
+    loop_.SetDeadline(repeat_.deadline_);
+  } else {
+    loop_.SetDeadline(pending_events_.Front().deadline_);
+  }
+}
+
+void FakeKeyboard::FireReadyEvents(struct timespec now) {
+  bool needs_syn = false;
+  SetEventTime(now);
+
+  // The key codes sent since the last SYN.  When committing early, a quick
+  // tap's down and up events become ready together, and in one report they
+  // would hide each other, so they are split up.
+  std::bitset<KEY_CNT> codes_sent;
+
+  // Loop over pending events and process any that are ready to fire.
+  struct timespec deadline;
+  while (FirstReadyDeadline(now, &deadline)) {
+    // The key repeat goes first if it's due, and no later than the next event.
+    bool is_repeat = repeating_ && !TimespecIsLater(repeat_.deadline_, now) &&
+                     !TimespecIsLater(repeat_.deadline_, deadline);
+    Event next_event = is_repeat ? repeat_ : pending_events_.Front();
+
+    // The repeat of a held key is only set while its finger is down, so it
+    // can go right out, and the next one is scheduled.  If the loop fell
+    // behind, the missed repeats are skipped rather than sent in a burst.
+    if (is_repeat) {
+      StopRepeat();
+      LOG(DEBUG) << "Event: EV_KEY, code " << next_event.ev_code_ <<
+                    " repeat\n";
+      if (rollover_) {
+        SendRolloverEvent(next_event, now);
       } else {
-        // If it was a touchscreen event but *not* the end of a snapshot, then
-        // just continue the loop.  This allows us to treat touchscreen events
-        // as atomic events where the entire snapshot arrives at one time.
+        SendEvent(EV_KEY, next_event.ev_code_, kKeyRepeatValue);
+        needs_syn = true;
+      }
+      struct timespec next_repeat = AddMsToTimespec(next_event.deadline_,
+                                                    repeat_period_ms_);
+      if (!TimespecIsLater(next_repeat, now)) {
+        next_repeat = AddMsToTimespec(now, repeat_period_ms_);
+      }
+      StartRepeat(next_event.ev_code_, next_event.tid_, next_repeat);
+      continue;
+    }
+
+    // Pop off the next pending event and process it now.
+    pending_events_.Pop();
+
+    // Look up the FingerData associated with this event and make sure the
+    // event is still valid.
+    std::unordered_map<int, FingerData>::iterator it;
+    it = finger_data_.find(next_event.tid_);
+    if (it != finger_data_.end()) {
+      // Its event is out of the queue now.
+      it->second.pending_event_ = kNoEvent;
+
+      // Here we check to see if this event is still valid before firing it
+      // off to the OS.  A tap that fails is a rejection, and the finger is
+      // marked so it isn't counted again as a tap when it lifts.
+      if (!TapIsValid(it->second)) {
+        LogTouchOutcome(it->second, "rejected, invalid tap");
+        RecordTouchOutcome(it->second, true, now);
+        it->second.rejection_status_ = RejectionStatus::kRejectInvalidTap;
         continue;
       }
+    } else {
+      // The finger has already left -- that's OK as long as it is
+      // "guaranteed" to fire.
+      if (!next_event.is_guaranteed_) {
+        LOG(ERROR) << "No finger data for event that should have some! " <<
+                     "(guaranteed: " << next_event.is_guaranteed_ << ", " <<
+                     "is_down: " << next_event.is_down_ << ", " <<
+                     "tid: " << next_event.tid_ << ")\n";
+      }
     }
 
-    // Loop over pending events and process any that are ready to fire.
-    while (!pending_events_.empty()) {
-      // If the next event's deadline is still in the future, stop looking.
-      Event next_event = pending_events_.front();
-      if (TimespecIsLater(next_event.deadline_, now)) {
-        break;
+    // The layout switching key isn't sent, a tap on it selects the next
+    // layout instead.
+    if (next_event.ev_code_ == kNextLayoutCode) {
+      if (next_event.is_down_) {
+        SelectLayout((layout_index_ + 1) % layouts_.size());
       }
+      continue;
+    }
 
-      // Pop off the next pending event and process it now.
-      pending_events_.pop_front();
+    // Neither are layer keys.  Toggles and one-shots only switch once the
+    // tap is confirmed, held layers already did when the key was touched.
+    if (IsLayerCode(next_event.ev_code_)) {
+      KeyBinding binding = BindingForCode(next_event.ev_code_);
+      if (next_event.is_down_ && binding.rule_ == LayerRule::kToggle) {
+        layers_.Toggle(binding.layer_);
+      } else if (next_event.is_down_ && binding.rule_ == LayerRule::kOneShot) {
+        layers_.OneShot(binding.layer_);
+      }
+      continue;
+    }
 
-      // Look up the FingerData associated with this event and make sure the
-      // event is still valid.
-      std::unordered_map<int, FingerData>::iterator it;
-      it = finger_data_.find(next_event.tid_);
-      if (it != finger_data_.end()) {
-        // Here we check to see if this event is still valid before firing it
-        // off to the OS.  Currently there is only a pressure check here, but
-        // more could easily be added later.
-
-        if (it->second.max_pressure_ != -1) {
-          // This checks if the maximum pressure a finger reported is within
-          // range.  An exception is made for the spacebar since it is often
-          // pressed by a user's thumb, which may have unusually high pressure.
-          if (it->second.max_pressure_ < kMinTapPressure ||
-              (layout_[it->second.starting_key_number_].event_code_ !=
-               KEY_SPACE && it->second.max_pressure_ > kMaxTapPressure)) {
-            LOG(INFO) << "Tap rejected!  Pressure of " <<
-              it->second.max_pressure_ << " is out of range " <<
-              kMinTapPressure << "->" << kMaxTapPressure << "\n";
-            continue;
-          }
-        } else {
-          if (it->second.max_touch_major_ < kMinTapTouchDiameter ||
-            (layout_[it->second.starting_key_number_].event_code_ !=
-             KEY_SPACE && it->second.max_touch_major_ > kMaxTapTouchDiameter)) {
-            LOG(INFO) << "Tap rejected!  Diameter of " <<
-              it->second.max_touch_major_ << " is out of range " <<
-              kMinTapTouchDiameter << "->" << kMaxTapTouchDiameter << "\n";
-            continue;
-          }
+    if (TimespecIsLater(next_event.deadline_, now)) {
+      struct timespec const &deadline = next_event.deadline_;
+      commit_stats_.early_events_++;
+      commit_stats_.saved_ns_ += (deadline.tv_sec - now.tv_sec) * 1000000000LL +
+                                 (deadline.tv_nsec - now.tv_nsec);
+      if (commit_stats_.early_events_ % kCommitStatsLogInterval == 0) {
+        LogCommitStats();
+      }
+    }
 
-        }
-      } else {
-        // The finger has already left -- that's OK as long as it is
-        // "guaranteed" to fire.
-        if (!next_event.is_guaranteed_) {
-          LOG(ERROR) << "No finger data for event that should have some! " <<
-                       "(guaranteed: " << next_event.is_guaranteed_ << ", " <<
-                       "is_down: " << next_event.is_down_ << ", " <<
-                       "tid: " << next_event.tid_ << ")\n";
-        }
+    if (commit_policy_ == CommitPolicy::kEarly && !rollover_ &&
+        next_event.ev_code_ >= 0 && next_event.ev_code_ < KEY_CNT) {
+      if (codes_sent.test(next_event.ev_code_)) {
+        SendEvent(EV_SYN, SYN_REPORT, 0);
+        codes_sent.reset();
       }
+      codes_sent.set(next_event.ev_code_);
+    }
 
-      LOG(DEBUG) << "Event: EV_KEY, code " << next_event.ev_code_ << " down: " << next_event.is_down_ << "\n";
-      // Actually send the event and update the fingerdata if applicable.
+    LOG(DEBUG) << "Event: EV_KEY, code " << next_event.ev_code_ << " down: " << next_event.is_down_ << "\n";
+    // Actually send the event and update the fingerdata if applicable.
+    if (rollover_) {
+      if (!SendRolloverEvent(next_event, now)) {
+        continue;
+      }
+    } else {
       SendEvent(EV_KEY, next_event.ev_code_, next_event.is_down_ ? 1 : 0);
       needs_syn = true;
-      if (next_event.is_down_) {
-        std::unordered_map<int, FingerData>::iterator it;
-        it = finger_data_.find(next_event.tid_);
-        if (it != finger_data_.end()) {
-          finger_data_[next_event.tid_].down_sent_ = true;
+    }
+
+    // Once the key is up it can't repeat, even if another finger is still
+    // holding it.
+    if (!next_event.is_down_ && repeating_ &&
+        repeat_.ev_code_ == next_event.ev_code_) {
+      StopRepeat();
+    }
+    if (next_event.is_down_) {
+      std::unordered_map<int, FingerData>::iterator it;
+      it = finger_data_.find(next_event.tid_);
+      if (it != finger_data_.end()) {
+        LogTouchOutcome(it->second, "committed");
+        it->second.down_sent_ = true;
+
+        // The key is still held, so it starts repeating after a while.
+        if (repeat_delay_ms_ > 0) {
+          StartRepeat(next_event.ev_code_, next_event.tid_,
+                      AddMsToTimespec(now, repeat_delay_ms_));
         }
       }
     }
-    if (needs_syn) {
-      // Finally, send out a SYN after all applicable events are sent.
-      SendEvent(EV_SYN, SYN_REPORT, 0);
+  }
+  if (needs_syn) {
+    // Finally, send out a SYN after all applicable events are sent.
+    SendEvent(EV_SYN, SYN_REPORT, 0);
+  }
+}
+
+bool FakeKeyboard::SendRolloverEvent(Event const &ev, struct timespec now) {
+  // The event is stamped with its deadline, or with now if it's early.
+  SetEventTime(TimespecIsLater(ev.deadline_, now) ? now : ev.deadline_);
+
+  int value = ev.is_repeat_ ? kKeyRepeatValue : ev.is_down_ ? 1 : 0;
+  if (!ev.is_repeat_ && ev.ev_code_ >= 0 && ev.ev_code_ < KEY_CNT) {
+    int &holder = key_holders_[ev.ev_code_];
+    if (ev.is_down_) {
+      // The kernel ignores a press of a key that is already down, so when
+      // fingers overlap on the same key, the earlier one lets go of it first.
+      if (holder != kNoHolder) {
+        LOG(DEBUG) << "Key " << ev.ev_code_ << " taken over from finger " <<
+                      holder << "\n";
+        SendEvent(EV_KEY, ev.ev_code_, 0);
+        SendEvent(EV_SYN, SYN_REPORT, 0);
+      }
+      holder = ev.source_tid_;
+    } else if (holder != ev.source_tid_) {
+      // Another finger pressed the key since, it's the one to release it.
+      LOG(DEBUG) << "Key " << ev.ev_code_ << " is held by finger " <<
+                    holder << ", not releasing it\n";
+      return false;
+    } else {
+      holder = kNoHolder;
     }
   }
+
+  SendEvent(EV_KEY, ev.ev_code_, value);
+  SendEvent(EV_SYN, SYN_REPORT, 0);
+  return true;
+}
+
+void FakeKeyboard::RequestStop() {
+  uint64_t one = 1;
+  syscall_handler()->write(stop_fd_, &one, sizeof(one));
+}
+
+void FakeKeyboard::HandleStopRequest() {
+  // Whatever was learned since it was last saved would be lost otherwise.
+  LOG(INFO) << "Stopping the keyboard.\n";
+  SaveDebounceState();
+  loop_.Quit();
 }
 
-void FakeKeyboard::Start(std::string const &source_device_path,
-                         std::string const &keyboard_device_name) {
-  // Do all the set up steps.
-  if (!OpenSourceDevice(source_device_path))
+void FakeKeyboard::Consume() {
+  // Touch frames wake the loop through the queue's fd, while the pending
+  // events are driven by the loop's timer, which is always armed for the
+  // deadline at the head of the queue.  Since the timer is absolute, events
+  // fire as close to their deadline as the scheduler allows and never early.
+  if (!loop_.Init()) {
     return;
+  }
+  loop_.AddFd(frames_->fd(), [this]() { HandleFramesReady(); });
+  loop_.AddFd(stop_fd_, [this]() { HandleStopRequest(); });
+  WatchLayouts();
+  loop_.SetTimerHandler([this](struct timespec const &deadline) {
+    AdvanceTo(deadline);
+    UpdateDeadline();
+  });
+  loop_.Run();
+}
 
-  CreateUinputFD();
+bool FakeKeyboard::Setup(std::string const &keyboard_device_name) {
+  if (!CreateUinputFD())
+    return false;
   EnableKeyboardEvents();
-  FinalizeUinputCreation(keyboard_device_name);
+  return FinalizeUinputCreation(keyboard_device_name);
+}
 
-  // Loop forever, comsuming the events coming in from the source device and
-  // generating keystroke events when appropriate.
+void FakeKeyboard::Start() {
+  // Loop until asked to stop, comsuming the frames coming in from the decoder
+  // and generating keystroke events when appropriate.
   Consume();
 }
 
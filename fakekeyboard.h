@@ -6,108 +6,32 @@
 #define TOUCH_KEYBOARD_FAKEKEYBOARD_H_
 
 #include <algorithm>
+#include <atomic>
 #include <base_macros.h>
-#include <list>
+#include <bitset>
+#include <memory>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string>
 #include <time.h>
 #include <unordered_map>
 #include <vector>
 
-#include "evdevsource.h"
+#include "clock.h"
+#include "debounce.h"
+#include "eventloop.h"
+#include "eventqueue.h"
+#include "framequeue.h"
 #include "haptic/touch_ff_manager.h"
+#include "hwconfig.h"
+#include "key.h"
+#include "layers.h"
+#include "layout.h"
 #include "statemachine/statemachine.h"
 #include "uinputdevice.h"
 
 namespace touch_keyboard {
 
-struct hw_config {
-  int rotation; // Hardware rotation of the touchpad, 90, 180 or 270 deg. CW
-  int res_x; // points
-  int res_y; // points
-  double width_mm; // mm
-  double height_mm; //mm
-  double left_margin_mm;
-  double top_margin_mm; // margins between physical edge and edge of keys layout
-};
-
-class Key {
- /* A class that represents a single key on the fake keyboard.
-  *
-  * This class is used to describe the location, size, and event code (which
-  * letter is on the key) for a single key on a fake keyboard and keep track
-  * of it's current state.  A keyboard's layout is defined as a vector of
-  * these Key objects.
-  */
- public:
-  Key(int event_code, int event_code_fn,
-	int xmin, int xmax, int ymin, int ymax) :
-	  event_code_(event_code), event_code_fn_(event_code_fn),
-	  xmin_(xmin), xmax_(xmax), ymin_(ymin),
-	  ymax_(ymax) {}
-
-  // Check if the point (x, y) is contained within this key.
-  bool Contains(int x, int y) const {
-    return (x < xmax_ && x >= xmin_ && y < ymax_ && y >= ymin_);
-  }
-
-  // This defines which event code to emit when this key is pressed.
-  // Essentially this specifies which key it is. (eg: KEY_A, KEY_BACKSPACE, etc)
-  int event_code_;
-
-  // The same for Fn modifier key pressed
-  int event_code_fn_;
-
-  // The range of x and y values that are contained within the key.
-  int xmin_, xmax_;
-  int ymin_, ymax_;
-};
-
-struct Event {
- /* A class to represent a pending keyboard event that is scheduled to be
-  * generated by the fake keyboard.
-  *
-  * As keys are pressed by the user, the FakeKeyboard class generates keyboard
-  * events, which represent the keys being pressed and released.  To allow some
-  * measure of revoking, events are enqueued and only released after a brief
-  * pause.  This way, if something unexpected happens to invalidate a keypress,
-  * the system can simply not send it.  These events are represented as Event
-  * objects stored in a queue.  They store all the information you need about
-  * a keyboard event such as which keycode it is for, which direction the key
-  * is going, and when the deadline to release the event is.
-  */
- public:
-  Event(int ev_code, bool is_down, struct timespec deadline, int tid) :
-    is_guaranteed_(false), ev_code_(ev_code), is_down_(is_down), tid_(tid),
-    deadline_(deadline) {}
-
-  // Some events are guaranteed to fire before their deadline expires.  For
-  // example, if a finger leaves before the deadline the system already knows
-  // everything about it and can make a decision right away.  Since there may
-  // be earlier, non-guaranteed events pending, we have to make such events
-  // guaranteed so that when they make it to the front of the queue, we know
-  // they are already checked and ready to go.
-  bool is_guaranteed_;
-
-  // This value stores which event code (which key) this event deals with.
-  int ev_code_;
-
-  // This value stores the "direction" of the event.  A value of true indicates
-  // that this is a key-down event whereas false indicates a key-up event.
-  bool is_down_;
-
-  // Here we store the tracking ID (tid) of the finger that triggered this
-  // event.  This is used to determine the validity of the event later, by
-  // looking up the finger's behavior via this tid.
-  int tid_;
-
-  // This timespec represents the deadline for this event to be emitted by.
-  // When an event is added to the queue a deadline is set briefly in the
-  // future.  When this deadline passes, the FakeKeyboard is forced to make a
-  // decision on whether or not the event is valid.
-  struct timespec deadline_;
-};
-
 // These values represent the various rejection states of a finger that
 // we're tracking on the touch keyboard and should be stored in their
 // corresponding FingerData.rejection_status values.
@@ -116,6 +40,25 @@ enum class RejectionStatus {
   kRejectTouchdownOffKey,
   kRejectMovedOffKey,
   kRejectAlreadyComplete,
+  kRejectEventsDropped,
+  kRejectPalm,
+  kRejectInvalidTap,
+};
+
+// When pending events are sent out.
+enum class CommitPolicy {
+  // Every event waits until its deadline.
+  kDeadline = 0,
+  // An event is sent as soon as its outcome is certain (it's guaranteed) and
+  // every event queued ahead of it has been sent, even before its deadline.
+  kEarly,
+};
+
+// Counts how much sooner events were sent by the kEarly commit policy than
+// their deadlines.
+struct CommitStats {
+  uint64_t early_events_;
+  uint64_t saved_ns_;
 };
 
 struct FingerData {
@@ -137,11 +80,27 @@ struct FingerData {
   // This value stores the maximum touch diameter reported for this contact
   int max_touch_major_;
 
+  // The layout that was active when the finger arrived.  The finger keeps
+  // using it even if the keyboard switches layouts in the meantime.
+  std::shared_ptr<Layout const> layout_;
+
   // Here we track which key in the layout the finger first appeared on.
   int starting_key_number_;
 
+  // How sure we are that the finger meant that key: 1 if it landed on it, less
+  // if it landed between keys and was given to the nearest one.
+  double key_confidence_;
+
+  // The key-down event this finger has waiting in the pending events, or
+  // kNoEvent once it was sent or cancelled.
+  EventHandle pending_event_;
+
   int event_code_;
 
+  // The layer this finger holds active because it's on a key that holds it,
+  // or 0.
+  int held_layer_;
+
   // This Boolean indicates if a "key down" event has already been sent because
   // of something this finger did, and as a result a "key up" event must be sent
   // eventually.
@@ -153,14 +112,14 @@ struct FingerData {
   RejectionStatus rejection_status_;
 };
 
-class FakeKeyboard : public UinputDevice, public EvdevSource {
+class FakeKeyboard : public UinputDevice {
  /* The FakeKeyboard class implements a kernel-level keyboard that
   * generates events by processing touch input and comparing them
   * to a predefined layout.
   *
   * A FakeKeyboard object consists of several parts:
-  *  1. It is an EvdevSource which pulls touch events from a source touch
-  *     sensor.
+  *  1. It consumes the decoded touch frames that a TouchDecoder publishes
+  *     into its FrameQueue.
   *  2. It is a UinputDevice which creates a fake input device in the
   *     kernel using the uinput module that will emit keyboard events.
   *  3. Finally, it includes logic to compare touches to a layout of keys
@@ -168,100 +127,316 @@ class FakeKeyboard : public UinputDevice, public EvdevSource {
   *     is intending to press
   *
   * To use this class, you should first instantiate a FakeKeyboard object
-  * then specify which device it is reading from.  When you run Start() the
-  * object will block forever, looping on the touch input and generating
-  * keyboard events.
+  * with the queue it is reading frames from and call Setup() to create the
+  * keyboard device.  When you run Start() the object will block forever,
+  * looping on the touch input and generating keyboard events.
   */
  public:
-  FakeKeyboard(struct hw_config &hw_config, TouchFFManager &ffManager);
-
-  // Use this function to actually start processing.  Start will block forever
-  // and should never return, but a new keyboard device should appear and
-  // begin sending out key events once you type on the touch sensor.
-  void Start(std::string const &source_device_path,
-             std::string const &keyboard_device_name);
+  // The syscall_handler is used for the uinput device and the clock for
+  // waiting on pending events outside of the event loop.  Either may be NULL
+  // to use the default one.
+  FakeKeyboard(struct hw_config &hw_config, TouchFFManager &ffManager,
+               FrameQueue *frames, SyscallHandler *syscall_handler = NULL,
+               Clock *clock = NULL);
+  ~FakeKeyboard();
+
+  // Create the uinput keyboard device.
+  bool Setup(std::string const &keyboard_device_name);
+
+  // Use this function to actually start processing.  Start will block until
+  // RequestStop() is called, and the keyboard device will begin sending out
+  // key events once you type on the touch sensor.
+  void Start();
+
+  // Instead of Start(), these can be used to drive the keyboard without an
+  // event loop, eg. when replaying a recording faster than real time.  The
+  // frames' timestamps serve as the current time, with pending events
+  // released as it passes their deadlines.  ProcessQueuedFrames() handles
+  // every frame currently queued, and FlushPendingEvents() stops any key
+  // repeat and waits on the clock for each remaining deadline until nothing
+  // is pending.  With a VirtualClock that takes no time at all.
+  void ProcessQueuedFrames();
+  void FlushPendingEvents();
+
+  // Choose when pending events are sent, the default is at their deadline.
+  void SetCommitPolicy(CommitPolicy policy) { commit_policy_ = policy; }
+
+  CommitStats const &commit_stats() const { return commit_stats_; }
+  void LogCommitStats() const;
+
+  // In rollover mode every key transition goes out in a report of its own,
+  // stamped with the time it was due, rather than together with everything
+  // else that was ready at the same time.  Which finger pressed each key is
+  // tracked too, so when a finger presses a key that another one is still
+  // holding, the key is released and pressed again instead of the second
+  // press being swallowed as a duplicate, and only the finger that pressed a
+  // key last releases it.
+  void SetRollover(bool rollover) { rollover_ = rollover; }
+
+  // Learn the delay key events are held back for from how the user's touches
+  // end, instead of always waiting the default 50 ms.  The delay stays within
+  // [min_ms, max_ms].  What was learned is kept in the file state_path, which
+  // is loaded now and saved every so often as well as by SaveDebounceState().
+  void SetAdaptiveDelay(std::string const &state_path, int min_ms, int max_ms);
+  void SaveDebounceState() const;
+
+  // Load another layout to switch to, in addition to layout.csv which is
+  // always the first one.  This has to be done before Setup() so the keys of
+  // every layout can be enabled on the device.
+  bool AddLayout(std::string const &path);
+
+  // Ask for a switch to the layout with this index, in the order they were
+  // added, or to the next one.  This is safe to call from any thread and even
+  // from a signal handler.  The switch happens before the next frame is
+  // processed, and fingers that are already down keep their layout.
+  void RequestLayout(int index) { requested_layout_.store(index); }
+  void RequestNextLayout() { requested_layout_.store(kNextLayoutRequest); }
+
+  // Ask the keyboard to save what it learned and return from Start().  Like
+  // RequestLayout(), this is safe to call from a signal handler.
+  void RequestStop();
+
+  // Repeat a held key every period_ms, starting delay_ms after it went down.
+  // Like the kernel does, only the most recently pressed key repeats.  A
+  // delay_ms of 0, the default, turns autorepeat off.
+  void SetAutorepeat(int delay_ms, int period_ms);
+
+  // Give fingers that land between keys to the nearest key, if it's no more
+  // than max_distance_mm away, instead of ignoring them.  A max_distance_mm of
+  // 0, the default, turns this off.
+  void SetGapResolution(double max_distance_mm) {
+    gap_distance_mm_ = max_distance_mm;
+  }
 
  private:
   // This is the workhorse function called by Start() that actually loops to
-  // consume the touch events and generate keystrokes.
+  // consume the touch frames and generate keystrokes.
   void Consume();
 
+  // Called by the event loop when new frames have been queued.
+  void HandleFramesReady();
+
+  // Called by the event loop once RequestStop() was called.
+  void HandleStopRequest();
+
+  // Send out every pending event and key repeat that is ready at time now, in
+  // the order of their deadlines, stopping at the first that isn't.
+  void FireReadyEvents(struct timespec now);
+
+  // Store in *deadline the deadline of whichever comes first of the pending
+  // event and the key repeat that are ready at time, and return true, or
+  // return false if neither is.
+  bool FirstReadyDeadline(struct timespec time,
+                          struct timespec *deadline) const;
+
+  // True if ev can be sent at time now, ie. its deadline has passed or the
+  // commit policy allows it to go early.
+  bool IsReady(Event const &ev, struct timespec now) const;
+
+  // Check the contact size and pressure of a finger to see if it was a valid
+  // tap on its key, using the thresholds of the key it started on.
+  bool TapIsValid(FingerData const &data) const;
+
+  // The delay for events of the key with index key_num in layout, or of no
+  // key in particular if it's kNoKey.
+  int KeyDelayMS(Layout const &layout, int key_num) const;
+
+  // Release the pending events with deadlines up to and including time, in
+  // the same groups they would have been sent in had the timer fired for
+  // each of those deadlines.
+  void AdvanceTo(struct timespec time);
+
+  // Arm the event loop's timer for the deadline at the head of
+  // pending_events_ or of the key repeat, whichever is first, or disarm it if
+  // there is neither.
+  void UpdateDeadline();
+
   // Use this function to enable the appropriate input events for the uinput
   // keyboard device when setting it up.  (eg: EV_KEY, KEY_ENTER, etc)
-  void EnableKeyboardEvents() const;
+  void EnableKeyboardEvents();
 
   // This function does all the necessary work on each full "snapshot"
   // describing the current state of the touchpad.  This includes things like
   // updating the current FingerData objects and making inferences based on
-  // finger position.
+  // finger position.  Only the contacts the frame marks as changed are looked
+  // at.
   void ProcessIncomingSnapshot(
       struct timespec now,
-      std::unordered_map<int, struct mtstatemachine::MtFinger> const &snapshot);
+      mtstatemachine::MtFrame const &frame);
+
+  // After the state machine was resynced because of dropped events, resolve
+  // every finger that vanished during the gap before the new snapshot is
+  // processed normally.
+  void HandleResync(
+      struct timespec now,
+      mtstatemachine::MtSnapshot const &snapshot);
 
-  // Load layout from CSV file
-  // Calling this function populates the layout_ member of a FakeKeyboard,
-  // filling it with the locations of each key printed on the touch sensor.
-  bool LoadLayout(std::string const &layout_filename);
+  // Switch layouts if that was asked for by RequestLayout().
+  void ApplyLayoutRequest();
+
+  // Make the layout with this index the active one for new fingers.
+  void SelectLayout(int index);
+
+  // Watch the directories of the layout files with inotify, so they are
+  // reloaded when they change.
+  void WatchLayouts();
+
+  // Called by the event loop when inotify reports changes.
+  void HandleLayoutChanges();
+
+  // Load the layout file at index again, replacing the old copy if that
+  // worked.
+  void ReloadLayout(int index);
 
   // Place ev into the event queue, while maintaining chronological order of
-  // the deadlines.
-  void EnqueueEvent(Event ev);
+  // the deadlines.  Returns the handle of the queued event.
+  EventHandle EnqueueEvent(Event const &ev);
 
   // Convenience function to build a guaranteed key-up event and enqueue it for
-  // the given event code using the default deadline.
-  void EnqueueKeyUpEvent(int ev_code, timespec now);
+  // the key of the finger tid using the default deadline.
+  void EnqueueKeyUpEvent(int tid, FingerData const &finger, timespec now);
+
+  // Send the key event ev at time now in rollover mode, in a report of its
+  // own.  Returns false if it was dropped because another finger has pressed
+  // the key since.
+  bool SendRolloverEvent(Event const &ev, struct timespec now);
+
+  // The deadline for an event that is enqueued at time now and held back for
+  // delay_ms.  It's never before the deadline of an event enqueued earlier,
+  // so keys with shorter delays or a shrinking adaptive delay can't reorder
+  // events.
+  struct timespec NextDeadline(struct timespec now, int delay_ms);
+
+  // Tell the debounce estimator how a touch ended, if the delay is adaptive.
+  void RecordTouchOutcome(FingerData const &data, bool rejected,
+                          struct timespec now);
+
+  // Release the layer the finger holds, if any.
+  void ReleaseLayer(FingerData *data);
 
   // Mark a given contact as rejected for the stated reason.  This scans for
   // all pending events associated with this tracking ID and rejects them all.
   void RejectFinger(int tid, RejectionStatus reason);
 
+  // Log that the touch of the finger data was committed or rejected, as given
+  // in outcome, with how sure it was about its key.  Touches that weren't
+  // certain are logged at INFO, so how the ones between keys turn out can be
+  // followed when tuning the gap distance.
+  void LogTouchOutcome(FingerData const &data,
+                       std::string const &outcome) const;
+
   // When a finger is leaving the pad, some special bookkeeping is required.
-  void HandleLeavingFinger(int tid, FingerData finger, timespec now);
+  void HandleLeavingFinger(int tid, FingerData const &finger, timespec now);
+
+  // Have the key ev_code, held by the finger tid, repeat at deadline.  This
+  // replaces any other key that was repeating.
+  void StartRepeat(int ev_code, int tid, struct timespec deadline);
+
+  // Stop the repeating key, if any.
+  void StopRepeat();
+
+  // Stop the repeating key if the finger tid is holding it.
+  void StopRepeatForFinger(int tid);
 
   // When a finger first arrives on the sensor some special setup is required.
+  // This returns the key it landed on, and stores what the key does in the
+  // active layer and the handle of the key-down event that was queued for it
+  // in *binding and *handle and how sure it is about the key in *confidence.
   int GenerateEventForArrivingFinger(
       struct timespec now,
       struct mtstatemachine::MtFinger const &finger, int tid,
-      int *event_code);
+      KeyBinding *binding, EventHandle *handle, double *confidence);
 
   // Confirm that a finger's correct position is still within the boundaries of
-  // the key that it initially arrived on.
+  // the key that it initially arrived on, or in the gaps around it if those
+  // are given to the nearest key.
   bool StillOnFirstKey(struct mtstatemachine::MtFinger const & finger,
                        FingerData const & data) const;
 
-  // This is a convenience function that allows for easy manipulation of
-  // timespec structs, which are used to track the deadlines for sending
-  // events.  To easily add a few ms to a timespec, you can just call this.
-  static struct timespec AddMsToTimespec(struct timespec const& orig,
-                                         int additional_ms);
-
-  // This is a convenience function that compares two timespecs, returning
-  // true if t1 comes *after* than t2.
-  static bool TimespecIsLater(struct timespec const& t1,
-                              struct timespec const& t2);
+  // Where FlushPendingEvents() waits for deadlines.
+  Clock *clock_;
 
   // The touch force feedback manager used to play ff effects.
   TouchFFManager *ff_manager_;
 
-  // This group of Key objects stores the full layout of the keyboard.
-  std::vector<Key> layout_;
+  // Special values for requested_layout_.
+  static constexpr int kNoLayoutRequest = -1;
+  static constexpr int kNextLayoutRequest = -2;
+
+  // Every layout that was loaded, and the one that's active for new fingers.
+  std::vector<std::shared_ptr<Layout const>> layouts_;
+  std::shared_ptr<Layout const> layout_;
+  int layout_index_;
 
-  // This state machine is used to interpret the raw touch events coming from
-  // the kernel -- separating them by finger/etc.
-  mtstatemachine::MtStateMachine sm_;
+  // The layout switch asked for by RequestLayout(), if any.
+  std::atomic<int> requested_layout_;
 
-  // This list of events stores all pending events in chronological order based
-  // on their deadlines.
-  std::list<Event> pending_events_;
+  // The eventfd RequestStop() wakes the event loop with.
+  int stop_fd_;
+
+  // The inotify instance watching the layout files, and which directory each
+  // of its watches is for.
+  int inotify_fd_;
+  std::unordered_map<int, std::string> watched_dirs_;
+
+  // The key codes enabled on the device.  Codes that only appear in a layout
+  // when it's reloaded can't be sent.
+  std::bitset<KEY_CNT> enabled_codes_;
+
+  // The longest delay set for any key in any of the layouts.
+  int max_key_delay_ms_;
+
+  // The loop that waits on the frame queue and pending event deadlines.
+  EventLoop loop_;
+
+  // Decoded touch frames, separated by finger/etc, are delivered here.
+  FrameQueue *frames_;
+
+  // This queue stores all pending events in chronological order based on their
+  // deadlines.
+  EventQueue pending_events_;
 
   // This is a mapping front tracking id's (TIDs) to finger information that
   // persists over the life of a contact to track global stats and information.
   std::unordered_map<int, FingerData> finger_data_;
 
-  bool fn_key_pressed_;
+  // The layers that are switched on, which decide the codes keys send.
+  LayerEngine layers_;
 
   struct hw_config hw_config_;
 
+  CommitPolicy commit_policy_;
+  CommitStats commit_stats_;
+
+  // How long new events are held back for, and the latest deadline given to
+  // any event so far.
+  int event_delay_ms_;
+  struct timespec last_deadline_;
+
+  // When the delay is adaptive, this learns it and its state is kept in
+  // debounce_state_path_.
+  bool adaptive_delay_;
+  DebounceEstimator debounce_;
+  std::string debounce_state_path_;
+
+  // The autorepeat settings, and the next repeat of the key that is held down
+  // if repeating_ is set.  The repeat isn't in pending_events_: it's only
+  // about timing and mustn't hold back the events queued behind it, so it has
+  // a deadline of its own.
+  int repeat_delay_ms_;
+  int repeat_period_ms_;
+  bool repeating_;
+  Event repeat_;
+
+  // Whether rollover mode is on, and for each key code the tracking ID of the
+  // finger whose key-down event was sent last, or kNoHolder if the key is up.
+  static constexpr int kNoHolder = -1;
+  bool rollover_;
+  std::vector<int> key_holders_;
+
+  // How far from a key a finger may land and still press it, or 0.
+  double gap_distance_mm_;
+
   DISALLOW_COPY_AND_ASSIGN(FakeKeyboard);
 };
 
@@ -11,13 +11,15 @@
 
 namespace touch_keyboard {
 
-FakeTouchpad::FakeTouchpad(struct hw_config &hw_config) :
-  hw_config_(hw_config) {
+FakeTouchpad::FakeTouchpad(struct hw_config &hw_config, FrameQueue *frames,
+                           SyscallHandler *syscall_handler) :
+  UinputDevice(syscall_handler), hw_config_(hw_config), frames_(frames),
+  sent_slot_(-1), sent_touch_count_(0), frame_has_events_(false) {
 
   if (!LoadLayout("layout-touchpad.csv"))
     throw "Failed to load touchpad geometry";
 
-  for (int i = 0; i < mtstatemachine::kNumSlots; i++) {
+  for (int i = 0; i < mtstatemachine::kMaxSlots; i++) {
     slot_memberships_.push_back(false);
   }
 }
@@ -93,11 +95,10 @@ bool FakeTouchpad::LoadLayout(std::string const &layout_filename) {
   return true;
 }
 
-void FakeTouchpad::Start(std::string const &source_device_path,
+bool FakeTouchpad::Setup(int source_evdev_fd,
                          std::string const &touchpad_device_name) {
-  if (!OpenSourceDevice(source_device_path))
-    return;
-  CreateUinputFD();
+  if (!CreateUinputFD())
+    return false;
 
   // Enable the few button events that touchpads need.
   EnableEventType(EV_KEY);
@@ -129,46 +130,87 @@ void FakeTouchpad::Start(std::string const &source_device_path,
   yres = round(h / height_mm_);
 
   // Duplicate the ABS events from the source device.
-  CopyABSOutputEvents(source_fd_, w, h, xres, yres);
+  if (!CopyABSOutputEvents(source_evdev_fd, w, h, xres, yres))
+    return false;
 
   // Finally, tell kernel to create the new fake touchpad's uinput device.
-  FinalizeUinputCreation(touchpad_device_name);
+  return FinalizeUinputCreation(touchpad_device_name);
+}
 
-  // Loop forever consuming the events coming in from the source device.
+void FakeTouchpad::Start() {
+  // Loop forever consuming the frames coming in from the decoder.
   Consume();
 }
 
 void FakeTouchpad::Consume() {
-  while (1) {
-    struct input_event ev;
-    bool event_ready = GetNextEvent(kNoTimeout, &ev);
-    // If we timed out waiting, then there is no event yet.
-    if (!event_ready) {
-      continue;
-    }
+  if (!loop_.Init()) {
+    return;
+  }
+  loop_.AddFd(frames_->fd(), [this]() { HandleFramesReady(); });
+  loop_.Run();
+}
+
+void FakeTouchpad::HandleFramesReady() {
+  frames_->ClearNotification();
+  ProcessQueuedFrames();
+}
 
-    if (sm_.AddEvent(ev, NULL)) {
-      // Sync over all the touch events from the source state machine.
-      int touch_count = SyncTouchEvents();
-      // Make sure the BTN events are correct since this is a fake touchpad.
-      SendTouchpadBtnEvents(touch_count);
-      // Finally send a SYN after all applicable events are sent.
+void FakeTouchpad::ProcessQueuedFrames() {
+  mtstatemachine::MtFrame const *frame;
+  while ((frame = frames_->Front()) != NULL) {
+    SetEventTime(frame->time_);
+    frame_has_events_ = false;
+    // Sync over all the touch events from the decoded frame.
+    int touch_count = SyncTouchEvents(*frame);
+    frames_->Pop();
+    // Make sure the BTN events are correct since this is a fake touchpad.
+    SendTouchpadBtnEvents(touch_count);
+    // Finally send a SYN after all applicable events are sent, if there were
+    // any.  Typing on the keyboard doesn't disturb the touchpad at all.
+    if (frame_has_events_) {
       SendEvent(EV_SYN, SYN_REPORT, 0);
     }
   }
 }
 
-void FakeTouchpad::SendTouchpadBtnEvents(int touch_count) const {
+void FakeTouchpad::SendTouchpadBtnEvents(int touch_count) {
   // Since this is a fake touchpad, we need to send BTN_TOUCH and BTN_TOOL_*
   // events whenever a finger arrives and leaves for the gesture library to
   // interpret the motions correctly.  This function generates those events
   // based on the number of fingers currently being reported by the fake
-  // touchpad.
-  SendEvent(EV_KEY, BTN_TOUCH, (touch_count > 0) ? 1 : 0);
-  SendEvent(EV_KEY, BTN_TOOL_FINGER, (touch_count == 1) ? 1 : 0);
-  SendEvent(EV_KEY, BTN_TOOL_DOUBLETAP, (touch_count == 2) ? 1 : 0);
-  SendEvent(EV_KEY, BTN_TOOL_TRIPLETAP, (touch_count == 3) ? 1 : 0);
-  SendEvent(EV_KEY, BTN_TOOL_QUADTAP, (touch_count == 4) ? 1 : 0);
+  // touchpad, leaving out the buttons that are already in that state.
+  static int const kButtons[] = {BTN_TOUCH, BTN_TOOL_FINGER,
+                                 BTN_TOOL_DOUBLETAP, BTN_TOOL_TRIPLETAP,
+                                 BTN_TOOL_QUADTAP};
+  bool const pressed[] = {touch_count > 0, touch_count == 1, touch_count == 2,
+                          touch_count == 3, touch_count == 4};
+  bool const was_pressed[] = {sent_touch_count_ > 0, sent_touch_count_ == 1,
+                              sent_touch_count_ == 2, sent_touch_count_ == 3,
+                              sent_touch_count_ == 4};
+  for (unsigned int i = 0; i < sizeof(kButtons) / sizeof(kButtons[0]); i++) {
+    if (pressed[i] != was_pressed[i]) {
+      SendEvent(EV_KEY, kButtons[i], pressed[i] ? 1 : 0);
+      frame_has_events_ = true;
+    }
+  }
+  sent_touch_count_ = touch_count;
+}
+
+void FakeTouchpad::SendSlotEvent(int slot, int code, int value) {
+  // The kernel would drop a value that didn't change anyway, but not before
+  // it was written.
+  mtstatemachine::Slot &sent = sent_values_[slot];
+  sent.ClearChanged();
+  sent.SetValue(EV_ABS, code, value);
+  if (!sent.HasChanged(EV_ABS, code)) {
+    return;
+  }
+  if (sent_slot_ != slot) {
+    SendEvent(EV_ABS, ABS_MT_SLOT, slot);
+    sent_slot_ = slot;
+  }
+  SendEvent(EV_ABS, code, value);
+  frame_has_events_ = true;
 }
 
 bool FakeTouchpad::Contains(mtstatemachine::Slot const &slot) const {
@@ -183,17 +225,16 @@ bool FakeTouchpad::Contains(mtstatemachine::Slot const &slot) const {
   return true;
 }
 
-bool FakeTouchpad::PassEventsThrough(mtstatemachine::Slot const &slot) const {
+void FakeTouchpad::PassEventsThrough(int slot,
+                                     mtstatemachine::Slot const &values,
+                                     bool changed_only) {
   // Go through the slot in question and send events setting each of the set
   // values into this region.  Essentially this updates all of the values for
   // this slot in the kernel to match our internal version.
-  // This function returns True if the updated slot represented a contact that
-  // is current on the touchpad.
   mtstatemachine::Slot::const_iterator it;
-  bool is_valid = false;
 
   // Iterate over each value in the slot and send the corresponding event.
-  for (it = slot.begin(); it != slot.end(); it++) {
+  for (it = values.begin(); it != values.end(); it++) {
     mtstatemachine::EventKey slot_event_key = it->first;
     int value = it->second;
     int code = slot_event_key.code_;
@@ -202,10 +243,10 @@ bool FakeTouchpad::PassEventsThrough(mtstatemachine::Slot const &slot) const {
     if (!slot_event_key.IsSupportedForTouchpads())
       continue;
 
-    // Check the tracking ID. (-1 indicates this contact is not valid anymore)
-    if (slot_event_key.IsTrackingID()) {
-      is_valid |= (value != -1);
-    }
+    // The kernel already has any value that stayed the same.
+    if (changed_only &&
+        !values.HasChanged(slot_event_key.type_, slot_event_key.code_))
+      continue;
 
     // Transform X and Y values to keep the corner of the region 0,0 and
     // invert any axes that were set to be inverted at creation.
@@ -245,13 +286,11 @@ bool FakeTouchpad::PassEventsThrough(mtstatemachine::Slot const &slot) const {
     }
 
     // Push an event that sets this value into the region.
-    SendEvent(slot_event_key.type_, code, value);
+    SendSlotEvent(slot, code, value);
   }
-
-  return is_valid;
 }
 
-int FakeTouchpad::SyncTouchEvents() {
+int FakeTouchpad::SyncTouchEvents(mtstatemachine::MtFrame const &frame) {
   // Scan through all the slots of the state machine and sync the
   // uinput device with it by copying over the touch events for any contacts
   // that are currently contained within the region, returning the number
@@ -259,33 +298,46 @@ int FakeTouchpad::SyncTouchEvents() {
   // the region and performs transformations on the coordinates to maintain
   // the illusion of a different device (shifting x/y, adding fake finger
   // arriving events, etc)
+  // Slots that didn't change since the last frame are already in sync, unless
+  // a contact on the touchpad turned out to be a palm.
   int touch_count = 0;
 
-  for (int slot = 0; slot < mtstatemachine::kNumSlots; slot++) {
-    // Send a SLOT message to make sure these events go to the right slot
-    SendEvent(EV_ABS, ABS_MT_SLOT, slot);
-
-    // Don't pass on events from contacts outside of the region.
-    if (!Contains(sm_.slots_[slot])) {
-      // If this slot just left the region, send a finger-leaving event.
-      if (slot_memberships_[slot]) {
-        SendEvent(EV_ABS, ABS_MT_TRACKING_ID, -1);
+  for (int slot = 0; slot < frame.num_slots_; slot++) {
+    mtstatemachine::Slot const &values = frame.slots_[slot];
+    bool palm = (frame.palm_slots_ >> slot) & 1;
+
+    if (((frame.changed_slots_ >> slot) & 1) ||
+        (palm && slot_memberships_[slot])) {
+      // Don't pass on events from contacts outside of the region, or from
+      // palms.  Neither from a slot whose contact lifted before it ever was
+      // on the touchpad, eg. because it was a palm.
+      int tid = values.FindValueByEvent(EV_ABS, ABS_MT_TRACKING_ID);
+      if (palm || !Contains(values) ||
+          (tid == -1 && !slot_memberships_[slot])) {
+        // If this slot just left the region, send a finger-leaving event.
+        if (slot_memberships_[slot]) {
+          SendSlotEvent(slot, ABS_MT_TRACKING_ID, -1);
+        }
+        slot_memberships_[slot] = false;
+        continue;
       }
-      slot_memberships_[slot] = false;
-      continue;
-    } else {
-      // If this slot just entered the region, send a finger-arrive event.
-      if (!slot_memberships_[slot]) {
-        int tid = sm_.slots_[slot].FindValueByEvent(EV_ABS,
-                                                    ABS_MT_TRACKING_ID);
-        SendEvent(EV_ABS, ABS_MT_TRACKING_ID, tid);
+
+      // If this slot just entered the region, send a finger-arrive event and
+      // every value, otherwise only the ones that changed.
+      bool entered = !slot_memberships_[slot];
+      if (entered) {
+        SendSlotEvent(slot, ABS_MT_TRACKING_ID, tid);
       }
       slot_memberships_[slot] = true;
+
+      // Scan through the slot and update the properties.
+      PassEventsThrough(slot, values, !entered);
     }
 
-    // Scan through the slot and update all the properties.
-    bool valid_finger = PassEventsThrough(sm_.slots_[slot]);
-    if (valid_finger && slot_memberships_[slot]) {
+    // Count the contacts that are currently on the touchpad. (A tracking ID
+    // of -1 indicates this contact is not valid anymore)
+    if (slot_memberships_[slot] &&
+        values.FindValueByEvent(EV_ABS, ABS_MT_TRACKING_ID) != -1) {
       touch_count++;
     }
   }
@@ -8,43 +8,62 @@
 #include <string>
 #include <vector>
 
-#include "evdevsource.h"
+#include "eventloop.h"
+#include "framequeue.h"
 #include "statemachine/statemachine.h"
 #include "uinputdevice.h"
 #include "fakekeyboard.h"
 
 namespace touch_keyboard {
 
-class FakeTouchpad : public UinputDevice, public EvdevSource {
+class FakeTouchpad : public UinputDevice {
  /* Generate a "fake" touchpad device that pulls it's touch events from a sub-
   * region of a larger touch sensor.
   *
-  * This class collects evdev events from one touch sensor and creates a
+  * This class consumes the decoded frames of one touch sensor and creates a
   * similar device with udev, then pipes events from a certain area through.
   * It also handles various bookkeeping with respect to which fingers are
   * within the "touchpad" region.  In essence, you initialize one of these
-  * objects with a source device and the area you want to treat as a touchpad.
-  * Then, when you run Start() it sets up the devices and will block forever
-  * passing though the appropriate events and modifying them to maintain the
-  * illusion of a normal touchpad.
+  * objects with the queue its frames arrive on and call Setup() with the
+  * source device to create a matching touchpad.  Then, when you run Start()
+  * it will block forever passing though the appropriate events and modifying
+  * them to maintain the illusion of a normal touchpad.
   */
  public:
-   FakeTouchpad(struct hw_config &hw_config);
+  // The syscall_handler is used for the uinput device and may be NULL to
+  // use the default one.
+  FakeTouchpad(struct hw_config &hw_config, FrameQueue *frames,
+               SyscallHandler *syscall_handler = NULL);
 
-  void Start(std::string const &source_device_path,
-             std::string const &touchpad_device_name);
+  // Create the uinput touchpad device, cloning the axes of the source device
+  // whose file descriptor is passed in.
+  bool Setup(int source_evdev_fd, std::string const &touchpad_device_name);
+
+  // Loop forever passing touch events through.
+  void Start();
+
+  // Instead of Start(), this can be used to pass through every frame that is
+  // currently queued without an event loop, eg. when replaying a recording.
+  void ProcessQueuedFrames();
 
  private:
   // Load touchpad geometry from file
   bool LoadLayout(std::string const &layout_filename);
 
-  // Loop forever consuming events from the source and emitting them from the
+  // Loop forever consuming frames from the decoder and emitting them from the
   // fake touchpad -- the main workhorse function that Start() calls.
   void Consume();
 
+  // Called by the event loop when new frames have been queued.
+  void HandleFramesReady();
+
   // Send button events indicating how many fingers are currently on the fake
-  // touchpad.
-  void SendTouchpadBtnEvents(int touch_count) const;
+  // touchpad, for the buttons that changed since the last frame.
+  void SendTouchpadBtnEvents(int touch_count);
+
+  // Send an ABS_MT value for slot, unless it's the value that was last sent
+  // for it.  The device is switched to slot first if it isn't already.
+  void SendSlotEvent(int slot, int code, int value);
 
   // Test to see if the finger who's data is stored in the slot is currently
   // within the region defined as the touchpad.
@@ -52,11 +71,13 @@ class FakeTouchpad : public UinputDevice, public EvdevSource {
 
   // Check the state of the input touch and sync the fake touchpad by passing
   // through any new updates.
-  int SyncTouchEvents();
+  int SyncTouchEvents(mtstatemachine::MtFrame const &frame);
 
-  // Used by SyncTouchEvents, this function blindly duplicates the state stored
-  // in the slot for the fake touchpad by replicating events for each value.
-  bool PassEventsThrough(mtstatemachine::Slot const &slot) const;
+  // Used by SyncTouchEvents, this function duplicates the state stored in the
+  // slot for the fake touchpad by replicating events for each value, or only
+  // for the values that changed in this frame if changed_only is set.
+  void PassEventsThrough(int slot, mtstatemachine::Slot const &values,
+                         bool changed_only);
 
   // These member variables store the ranges of x/y coordinates that make up
   // the "touchpad" area on the source input device.
@@ -67,14 +88,27 @@ class FakeTouchpad : public UinputDevice, public EvdevSource {
 
   struct hw_config hw_config_;
 
-  // Every FakeTouchpad needs a state machine to interpret incoming events, it
-  // is defined and created here as a member of each object.
-  mtstatemachine::MtStateMachine sm_;
+  // The loop that waits for frames to arrive.
+  EventLoop loop_;
+
+  // The decoded touch frames to pass through are delivered here.
+  FrameQueue *frames_;
 
   // Here we store a mapping that determines which slots are in the touchpad
   // region or not currently.
   std::vector<bool> slot_memberships_;
 
+  // What the device was last sent: the values of each slot, the slot it was
+  // switched to (or -1 before the first) and the number of contacts its
+  // buttons were set for.  Only what differs from these is sent, and a frame
+  // that changes nothing doesn't even get a SYN.
+  mtstatemachine::Slot sent_values_[mtstatemachine::kMaxSlots];
+  int sent_slot_;
+  int sent_touch_count_;
+
+  // Set once an event was sent for the frame being processed.
+  bool frame_has_events_;
+
   DISALLOW_COPY_AND_ASSIGN(FakeTouchpad);
 };
 
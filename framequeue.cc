@@ -0,0 +1,82 @@
+// Copyright 2016 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "framequeue.h"
+
+namespace touch_keyboard {
+
+static_assert((kFrameQueueSize & (kFrameQueueSize - 1)) == 0,
+              "kFrameQueueSize must be a power of two");
+
+FrameQueue::~FrameQueue() {
+  if (event_fd_ >= 0) {
+    syscall_handler_->close(event_fd_);
+  }
+}
+
+bool FrameQueue::Init() {
+  event_fd_ = syscall_handler_->eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (event_fd_ < 0) {
+    PLOG(ERROR) << "Unable to create eventfd (" << event_fd_ << ")\n";
+    return false;
+  }
+  return true;
+}
+
+bool FrameQueue::Push(mtstatemachine::MtFrame const &frame) {
+  uint32_t tail = tail_.load(std::memory_order_relaxed);
+  if (tail - head_.load() == kFrameQueueSize) {
+    num_dropped_++;
+    carry_resync_ |= frame.resynced_;
+    carry_changes_ = true;
+    LOG(WARNING) << "Frame queue is full, dropping frame (" << num_dropped_ <<
+                    " dropped so far)\n";
+    return false;
+  }
+
+  mtstatemachine::MtFrame *slot = &frames_[tail & (kFrameQueueSize - 1)];
+  *slot = frame;
+  if (carry_resync_) {
+    // A resync notice must not get lost along with a dropped frame.
+    slot->resynced_ = true;
+    carry_resync_ = false;
+  }
+  if (carry_changes_) {
+    slot->MarkAllChanged();
+    carry_changes_ = false;
+  }
+  tail_.store(tail + 1);
+
+  // The consumer only needs waking if it may have seen the queue empty.  If
+  // it is still busy with older frames it will pick this one up on its own.
+  // Both sides use sequentially consistent accesses for the indices so that
+  // one of them is guaranteed to notice the other.
+  if (head_.load() == tail) {
+    uint64_t one = 1;
+    if (syscall_handler_->write(event_fd_, &one, sizeof(one)) !=
+        sizeof(one)) {
+      PLOG(ERROR) << "Unable to signal frame queue eventfd\n";
+    }
+  }
+  return true;
+}
+
+void FrameQueue::ClearNotification() {
+  uint64_t count;
+  syscall_handler_->read(event_fd_, &count, sizeof(count));
+}
+
+mtstatemachine::MtFrame const *FrameQueue::Front() const {
+  uint32_t head = head_.load(std::memory_order_relaxed);
+  if (head == tail_.load()) {
+    return NULL;
+  }
+  return &frames_[head & (kFrameQueueSize - 1)];
+}
+
+void FrameQueue::Pop() {
+  head_.store(head_.load(std::memory_order_relaxed) + 1);
+}
+
+}  // namespace touch_keyboard
@@ -0,0 +1,103 @@
+// Copyright 2016 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_FRAMEQUEUE_H_
+#define TOUCH_KEYBOARD_FRAMEQUEUE_H_
+
+#include <atomic>
+#include <logging.h>
+#include <stdint.h>
+
+#include "base_macros.h"
+#include "statemachine/statemachine.h"
+#include "syscallhandler.h"
+
+namespace touch_keyboard {
+
+// The number of decoded frames that can be waiting in a FrameQueue.  This has
+// to be a power of two.  At the sensor's report rate this is about half a
+// second of backlog, which a consumer should never get near.
+constexpr uint32_t kFrameQueueSize = 64;
+
+class FrameQueue {
+ /* A lock-free single-producer, single-consumer queue of decoded frames.
+  *
+  * The thread that decodes the touch sensor pushes every completed MtFrame
+  * into one FrameQueue per consumer, and each consumer pops them from its own
+  * thread.  The frames live in a preallocated ring so after the first lap
+  * no memory is allocated, and the only synchronization is a pair of atomic
+  * indices.
+  *
+  * To let the consumer sleep in an EventLoop, the queue owns an eventfd that
+  * becomes readable whenever a frame is pushed into an empty queue.  The
+  * consumer should call ClearNotification() before draining the queue with
+  * Front()/Pop() so that no wakeup can be lost.
+  */
+ public:
+  FrameQueue() : syscall_handler_(&default_syscall_handler), event_fd_(-1),
+                 head_(0), tail_(0), num_dropped_(0), carry_resync_(false),
+                 carry_changes_(false) {}
+  explicit FrameQueue(SyscallHandler *syscall_handler) :
+      syscall_handler_(syscall_handler), event_fd_(-1), head_(0), tail_(0),
+      num_dropped_(0), carry_resync_(false), carry_changes_(false) {
+    if (syscall_handler_ == NULL) {
+      syscall_handler_ = &default_syscall_handler;
+    }
+  }
+
+  ~FrameQueue();
+
+  // Create the eventfd used to wake the consumer.
+  bool Init();
+
+  // The file descriptor that becomes readable when frames are available.
+  int fd() const { return event_fd_; }
+
+  // Producer side: copy frame into the queue.  If the consumer has fallen so
+  // far behind that the queue is full, the frame is dropped and false is
+  // returned.  Since every frame carries the full touch state, the consumer
+  // catches up as soon as it sees the next one, which is marked as changed
+  // everywhere for that.
+  bool Push(mtstatemachine::MtFrame const &frame);
+
+  // Consumer side: reset the eventfd.  Call this before draining the queue.
+  void ClearNotification();
+
+  // Consumer side: the oldest frame in the queue, or NULL if it's empty.  The
+  // frame stays valid until Pop() is called.
+  mtstatemachine::MtFrame const *Front() const;
+
+  // Consumer side: release the frame returned by Front().
+  void Pop();
+
+ private:
+  SyscallHandler *syscall_handler_;
+  int event_fd_;
+
+  // head_ is the index of the next frame to be consumed and is only written
+  // by the consumer; tail_ is the index the next frame will be pushed to and
+  // is only written by the producer.  Both run freely and are wrapped with
+  // kFrameQueueSize when indexing.
+  std::atomic<uint32_t> head_;
+  std::atomic<uint32_t> tail_;
+
+  // Only touched by the producer, used for logging.
+  uint32_t num_dropped_;
+
+  // Set when a dropped frame was a resync, so the next frame that makes it
+  // into the queue can be marked as one instead.
+  bool carry_resync_;
+
+  // Set when any frame was dropped.  The changes it recorded are lost, so the
+  // next frame that makes it into the queue is marked as changed everywhere.
+  bool carry_changes_;
+
+  mtstatemachine::MtFrame frames_[kFrameQueueSize];
+
+  DISALLOW_COPY_AND_ASSIGN(FrameQueue);
+};
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_FRAMEQUEUE_H_
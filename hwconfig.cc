@@ -0,0 +1,71 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "hwconfig.h"
+
+#include <logging.h>
+
+#define CSV_IO_NO_THREAD
+#include "csv.h"
+
+#include "layoutblob.h"
+
+namespace touch_keyboard {
+
+bool LoadHWConfig(std::string const &hw_config_file,
+                  struct hw_config &hw_config) {
+  // The built in layouts remember the configuration they were compiled for,
+  // so if this is the file it came from, there's no need to parse it.
+  uint64_t hash;
+  bool is_builtin = false;
+  if (HashFile(hw_config_file, &hash)) {
+    for (int i = 0; i < kNumBuiltinLayouts && !is_builtin; i++) {
+      LayoutBlobHeader const *header =
+          reinterpret_cast<LayoutBlobHeader const *>(kBuiltinLayouts[i].blob_);
+      if (header->hw_source_hash_ == hash) {
+        FromLayoutBlobHWConfig(header->hw_config_, &hw_config);
+        is_builtin = true;
+      }
+    }
+  }
+
+  if (!is_builtin) {
+    io::CSVReader<7,
+      io::trim_chars<' ', '\t'>,
+      io::no_quote_escape<';'>> csv(hw_config_file);
+
+    csv.read_header(io::ignore_no_column,
+        "resolution_x", "resolution_y",
+        "width_mm", "height_mm",
+        "left_margin_mm", "top_margin_mm",
+        "rotation_cw");
+
+    int res_x, res_y;
+    double w_mm, h_mm;
+    double left_margin_mm, top_margin_mm;
+    int rotation;
+
+    if (!csv.read_row(res_x, res_y, w_mm, h_mm,
+                      left_margin_mm, top_margin_mm, rotation))
+      return false;
+
+    hw_config.res_x = res_x;
+    hw_config.res_y = res_y;
+    hw_config.width_mm = w_mm;
+    hw_config.height_mm = h_mm;
+    hw_config.rotation = rotation;
+    hw_config.left_margin_mm = left_margin_mm;
+    hw_config.top_margin_mm = top_margin_mm;
+  }
+
+  LOG(INFO) << "Touchpad HW config: " << hw_config.res_x << "x" <<
+    hw_config.res_y << " points, " <<
+    hw_config.width_mm << "x" << hw_config.height_mm << " mm, margins is " <<
+    hw_config.left_margin_mm << "+" << hw_config.top_margin_mm <<
+    ", rotated by " << hw_config.rotation << " deg. clockwise.\n";
+
+  return true;
+}
+
+}  // namespace touch_keyboard
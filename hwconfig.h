@@ -0,0 +1,29 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_HWCONFIG_H_
+#define TOUCH_KEYBOARD_HWCONFIG_H_
+
+#include <string>
+
+namespace touch_keyboard {
+
+struct hw_config {
+  int rotation; // Hardware rotation of the touchpad, 90, 180 or 270 deg. CW
+  int res_x; // points
+  int res_y; // points
+  double width_mm; // mm
+  double height_mm; //mm
+  double left_margin_mm;
+  double top_margin_mm; // margins between physical edge and edge of keys layout
+};
+
+// Read the hardware configuration from a CSV file.  Returns false if there's
+// no configuration in it.
+bool LoadHWConfig(std::string const &hw_config_file,
+                  struct hw_config &hw_config);
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_HWCONFIG_H_
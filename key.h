@@ -0,0 +1,89 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_KEY_H_
+#define TOUCH_KEYBOARD_KEY_H_
+
+#include <array>
+#include <vector>
+
+namespace touch_keyboard {
+
+// The number of layers a layout can have.  Layer 0 is the base layer and
+// layer 1 is the one Fn switches to.
+constexpr int kMaxLayers = 4;
+
+// A rectangular area of the touch sensor, in the sensor's coordinates.
+struct KeyRect {
+  // Check if the point (x, y) is contained within this rectangle.
+  bool Contains(int x, int y) const {
+    return (x < xmax_ && x >= xmin_ && y < ymax_ && y >= ymin_);
+  }
+
+  int xmin_, xmax_;
+  int ymin_, ymax_;
+};
+
+// Tuning values for a single key, each of them optional in the layout.  A
+// value of 0 means it wasn't given and the keyboard's default applies.
+struct KeyParams {
+  // How long events for the key are held back before they are sent.
+  int delay_ms_;
+
+  // The range the maximum pressure of a tap has to be in, and the range of
+  // its maximum contact diameter for sensors that don't report pressure.
+  int min_pressure_, max_pressure_;
+  int min_touch_major_, max_touch_major_;
+};
+
+class Key {
+ /* A class that represents a single key on the fake keyboard.
+  *
+  * This class is used to describe the location, size, and event codes (which
+  * letter is on the key in each layer) for a single key on a fake keyboard
+  * and keep track of it's current state.  A keyboard's layout is defined as a
+  * vector of these Key objects.
+  *
+  * Most keys are a single rectangle, but a key may be made of several, like
+  * the L-shaped ISO Enter key.
+  */
+ public:
+  Key(std::array<int, kMaxLayers> const &event_codes,
+	int xmin, int xmax, int ymin, int ymax) :
+	  event_codes_(event_codes), params_({0, 0, 0, 0, 0}) {
+    AddRect(xmin, xmax, ymin, ymax);
+  }
+
+  // Extend the key by another rectangle.
+  void AddRect(int xmin, int xmax, int ymin, int ymax) {
+    KeyRect rect = {xmin, xmax, ymin, ymax};
+    rects_.push_back(rect);
+  }
+
+  // Check if the point (x, y) is contained within this key.
+  bool Contains(int x, int y) const {
+    for (KeyRect const &rect : rects_) {
+      if (rect.Contains(x, y)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // This defines which event code to emit when this key is pressed in each
+  // layer.  Essentially this specifies which key it is. (eg: KEY_A,
+  // KEY_BACKSPACE, etc)  A code of 0 in any layer but the base one means the
+  // key sends its base code there.
+  std::array<int, kMaxLayers> event_codes_;
+
+  // The tuning values given for this key in the layout.
+  KeyParams params_;
+
+  // The areas of the sensor that make up the key.
+  std::vector<KeyRect> rects_;
+};
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_KEY_H_
@@ -0,0 +1,234 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "keygrid.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <limits>
+
+namespace touch_keyboard {
+
+KeyGrid::KeyGrid() : xmin_(0), ymin_(0), cell_width_(1), cell_height_(1),
+                     columns_(0), rows_(0), cell_start_(1, 0) {}
+
+void KeyGrid::Build(std::vector<Key> const &keys, int cell_width,
+                    int cell_height) {
+  cell_width_ = std::max(cell_width, 1);
+  cell_height_ = std::max(cell_height, 1);
+  entries_.clear();
+
+  // The grid only has to span the area the keys cover.
+  int xmin = INT_MAX, ymin = INT_MAX, xmax = INT_MIN, ymax = INT_MIN;
+  for (Key const &key : keys) {
+    for (KeyRect const &rect : key.rects_) {
+      xmin = std::min(xmin, rect.xmin_);
+      ymin = std::min(ymin, rect.ymin_);
+      xmax = std::max(xmax, rect.xmax_);
+      ymax = std::max(ymax, rect.ymax_);
+    }
+  }
+  if (xmin >= xmax || ymin >= ymax) {
+    columns_ = rows_ = 0;
+    cell_start_.assign(1, 0);
+    return;
+  }
+  xmin_ = xmin;
+  ymin_ = ymin;
+  columns_ = (xmax - xmin + cell_width_ - 1) / cell_width_;
+  rows_ = (ymax - ymin + cell_height_ - 1) / cell_height_;
+
+  // Count the rectangles overlapping each cell first so the lists can be laid
+  // out in place, then fill them in.  Going through the keys in order keeps
+  // each cell's list in layout order.
+  int num_cells = columns_ * rows_;
+  std::vector<uint32_t> counts(num_cells + 1, 0);
+  for (int pass = 0; pass < 2; pass++) {
+    for (unsigned int key_num = 0; key_num < keys.size(); key_num++) {
+      for (KeyRect const &rect : keys[key_num].rects_) {
+        if (rect.xmin_ >= rect.xmax_ || rect.ymin_ >= rect.ymax_) {
+          continue;
+        }
+        int col1 = (rect.xmin_ - xmin_) / cell_width_;
+        int col2 = (rect.xmax_ - 1 - xmin_) / cell_width_;
+        int row1 = (rect.ymin_ - ymin_) / cell_height_;
+        int row2 = (rect.ymax_ - 1 - ymin_) / cell_height_;
+        for (int row = row1; row <= row2; row++) {
+          for (int col = col1; col <= col2; col++) {
+            int cell = row * columns_ + col;
+            if (pass == 0) {
+              counts[cell]++;
+            } else {
+              Entry entry = {rect, static_cast<int>(key_num)};
+              entries_[counts[cell]++] = entry;
+            }
+          }
+        }
+      }
+    }
+
+    if (pass == 0) {
+      cell_start_.assign(num_cells + 1, 0);
+      for (int cell = 0; cell < num_cells; cell++) {
+        cell_start_[cell + 1] = cell_start_[cell] + counts[cell];
+      }
+      entries_.resize(cell_start_[num_cells]);
+      // Reuse the counts as the fill position of each cell.
+      std::copy(cell_start_.begin(), cell_start_.end(), counts.begin());
+    }
+  }
+}
+
+void KeyGrid::Restore(int xmin, int ymin, int cell_width, int cell_height,
+                      int columns, int rows, std::vector<uint32_t> cell_start,
+                      std::vector<Entry> entries) {
+  xmin_ = xmin;
+  ymin_ = ymin;
+  cell_width_ = cell_width;
+  cell_height_ = cell_height;
+  columns_ = columns;
+  rows_ = rows;
+  cell_start_.swap(cell_start);
+  entries_.swap(entries);
+}
+
+int KeyGrid::Find(int x, int y) const {
+  if (x < xmin_ || y < ymin_) {
+    return -1;
+  }
+  int col = (x - xmin_) / cell_width_;
+  int row = (y - ymin_) / cell_height_;
+  if (col >= columns_ || row >= rows_) {
+    return -1;
+  }
+
+  // Cells are small compared to keys, so there are only ever a few entries
+  // to check here.  They are in layout order, so the first hit is the key a
+  // linear scan of the layout would have found.
+  int cell = row * columns_ + col;
+  for (uint32_t i = cell_start_[cell]; i < cell_start_[cell + 1]; i++) {
+    if (entries_[i].rect_.Contains(x, y)) {
+      return entries_[i].key_;
+    }
+  }
+  return -1;
+}
+
+NearestKeyField::NearestKeyField() : cell_width_(1), cell_height_(1),
+                                     columns_(0), rows_(0), pitch_x_(1),
+                                     pitch_y_(1), cell_start_(1, 0) {}
+
+void NearestKeyField::Build(std::vector<Key> const &keys, int width,
+                            int height, int cell_width, int cell_height,
+                            double pitch_x, double pitch_y) {
+  cell_width_ = std::max(cell_width, 1);
+  cell_height_ = std::max(cell_height, 1);
+  columns_ = (std::max(width, 0) + cell_width_ - 1) / cell_width_;
+  rows_ = (std::max(height, 0) + cell_height_ - 1) / cell_height_;
+  pitch_x_ = pitch_x;
+  pitch_y_ = pitch_y;
+  cell_start_.assign(1, 0);
+  cell_keys_.clear();
+
+  // No point of a cell is further away from its closest key than the
+  // smallest of the keys' longest distances to the cell, or from its second
+  // closest key than the second smallest.  Keys whose shortest distance to
+  // the cell is longer than that can't be either.  This measures every cell
+  // against every key, but only once when the layout is loaded.
+  std::vector<double> min_mm(keys.size()), max_mm(keys.size());
+  for (int row = 0; row < rows_; row++) {
+    for (int col = 0; col < columns_; col++) {
+      int xmin = col * cell_width_, ymin = row * cell_height_;
+      double first = std::numeric_limits<double>::infinity();
+      double second = first;
+      for (unsigned int key_num = 0; key_num < keys.size(); key_num++) {
+        AreaDistanceMM(keys[key_num], xmin, xmin + cell_width_, ymin,
+                       ymin + cell_height_, &min_mm[key_num],
+                       &max_mm[key_num]);
+        if (max_mm[key_num] < first) {
+          second = first;
+          first = max_mm[key_num];
+        } else if (max_mm[key_num] < second) {
+          second = max_mm[key_num];
+        }
+      }
+      for (unsigned int key_num = 0; key_num < keys.size(); key_num++) {
+        if (min_mm[key_num] <= second) {
+          cell_keys_.push_back(key_num);
+        }
+      }
+      cell_start_.push_back(cell_keys_.size());
+    }
+  }
+}
+
+void NearestKeyField::Restore(int cell_width, int cell_height, int columns,
+                              int rows, double pitch_x, double pitch_y,
+                              std::vector<uint32_t> cell_start,
+                              std::vector<int32_t> cell_keys) {
+  cell_width_ = cell_width;
+  cell_height_ = cell_height;
+  columns_ = columns;
+  rows_ = rows;
+  pitch_x_ = pitch_x;
+  pitch_y_ = pitch_y;
+  cell_start_.swap(cell_start);
+  cell_keys_.swap(cell_keys);
+}
+
+int NearestKeyField::Find(std::vector<Key> const &keys, int x, int y,
+                          double *distance_mm,
+                          double *second_distance_mm) const {
+  *distance_mm = *second_distance_mm = std::numeric_limits<double>::infinity();
+  if (x < 0 || y < 0) {
+    return -1;
+  }
+  int col = x / cell_width_;
+  int row = y / cell_height_;
+  if (col >= columns_ || row >= rows_) {
+    return -1;
+  }
+
+  int cell = row * columns_ + col;
+  int nearest = -1;
+  for (uint32_t i = cell_start_[cell]; i < cell_start_[cell + 1]; i++) {
+    double distance = DistanceMM(keys[cell_keys_[i]], x, y);
+    if (distance < *distance_mm) {
+      *second_distance_mm = *distance_mm;
+      *distance_mm = distance;
+      nearest = cell_keys_[i];
+    } else if (distance < *second_distance_mm) {
+      *second_distance_mm = distance;
+    }
+  }
+  return nearest;
+}
+
+double NearestKeyField::DistanceMM(Key const &key, int x, int y) const {
+  double min_mm, max_mm;
+  AreaDistanceMM(key, x, x, y, y, &min_mm, &max_mm);
+  return min_mm;
+}
+
+void NearestKeyField::AreaDistanceMM(Key const &key, int xmin, int xmax,
+                                     int ymin, int ymax, double *min_mm,
+                                     double *max_mm) const {
+  // The distance to a rectangle is made of the distances along each axis,
+  // which are shortest at the nearest and longest at the farthest edge of the
+  // area.  The key is as close as its closest rectangle.
+  *min_mm = *max_mm = std::numeric_limits<double>::infinity();
+  for (KeyRect const &rect : key.rects_) {
+    int near_x = std::max(std::max(rect.xmin_ - xmax, xmin - rect.xmax_), 0);
+    int near_y = std::max(std::max(rect.ymin_ - ymax, ymin - rect.ymax_), 0);
+    int far_x = std::max(std::max(rect.xmin_ - xmin, xmax - rect.xmax_), 0);
+    int far_y = std::max(std::max(rect.ymin_ - ymin, ymax - rect.ymax_), 0);
+    *min_mm = std::min(*min_mm, std::hypot(near_x / pitch_x_,
+                                           near_y / pitch_y_));
+    *max_mm = std::min(*max_mm, std::hypot(far_x / pitch_x_,
+                                           far_y / pitch_y_));
+  }
+}
+
+}  // namespace touch_keyboard
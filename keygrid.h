@@ -0,0 +1,139 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_KEYGRID_H_
+#define TOUCH_KEYBOARD_KEYGRID_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "key.h"
+
+namespace touch_keyboard {
+
+class KeyGrid {
+ /* A spatial index to find the key under a point of the touch sensor.
+  *
+  * The area covered by the layout is split into a uniform grid of cells and
+  * each cell lists the key rectangles that overlap it.  Finding the key for
+  * a point is then a matter of computing its cell and testing the handful of
+  * rectangles listed there, no matter how many keys the layout has.  The
+  * index works on the rectangles in sensor coordinates, after the layout was
+  * rotated, so it's the same for every rotation.
+  *
+  * The lists of all the cells are stored back to back in one array, with a
+  * second array holding where each cell's list starts.
+  */
+ public:
+  // A rectangle of a key that overlaps a cell, and which key it belongs to.
+  struct Entry {
+    KeyRect rect_;
+    int key_;
+  };
+
+  KeyGrid();
+
+  // Index keys using cells of cell_width x cell_height sensor units.  Where
+  // keys overlap, the one that comes first in keys wins, the same as a
+  // linear scan through the layout.
+  void Build(std::vector<Key> const &keys, int cell_width, int cell_height);
+
+  // Take over an index that was built before, eg. one loaded from a compiled
+  // layout, as given by the accessors below.
+  void Restore(int xmin, int ymin, int cell_width, int cell_height,
+               int columns, int rows, std::vector<uint32_t> cell_start,
+               std::vector<Entry> entries);
+
+  // Return the index of the key that contains the point (x, y) or -1 if there
+  // is none.
+  int Find(int x, int y) const;
+
+  int xmin() const { return xmin_; }
+  int ymin() const { return ymin_; }
+  int cell_width() const { return cell_width_; }
+  int cell_height() const { return cell_height_; }
+  int columns() const { return columns_; }
+  int rows() const { return rows_; }
+  std::vector<uint32_t> const &cell_start() const { return cell_start_; }
+  std::vector<Entry> const &entries() const { return entries_; }
+
+ private:
+  // The sensor coordinates of the top left corner of the grid.
+  int xmin_, ymin_;
+
+  int cell_width_, cell_height_;
+  int columns_, rows_;
+
+  // The entries of cell c are entries_[cell_start_[c]] up to, but not
+  // including, entries_[cell_start_[c + 1]].
+  std::vector<uint32_t> cell_start_;
+  std::vector<Entry> entries_;
+};
+
+class NearestKeyField {
+ /* A precomputed map of the keys closest to each point of the touch sensor.
+  *
+  * Touches that land in the gaps between keys can be given to the key they
+  * were closest to.  To find it without measuring the distance to every key,
+  * the whole sensor is split into a uniform grid of cells, and each cell
+  * lists the keys that may be the closest or second closest to some point in
+  * it.  Every other key is further away from all of the cell than two of the
+  * listed ones are, so only the listed keys have to be measured.  Cells are
+  * small compared to keys, so that's usually just two or three of them, no
+  * matter how many keys the layout has.
+  *
+  * Like in KeyGrid, the lists of all the cells are stored back to back.
+  * Distances are in mm, since the sensor's resolution may differ between its
+  * axes.
+  */
+ public:
+  NearestKeyField();
+
+  // Map the keys on a sensor of width x height units, with pitch_x and
+  // pitch_y units per mm, using cells of cell_width x cell_height units.
+  void Build(std::vector<Key> const &keys, int width, int height,
+             int cell_width, int cell_height, double pitch_x, double pitch_y);
+
+  // Take over a field that was built before, as given by the accessors below.
+  void Restore(int cell_width, int cell_height, int columns, int rows,
+               double pitch_x, double pitch_y, std::vector<uint32_t> cell_start,
+               std::vector<int32_t> cell_keys);
+
+  // Return the index of the key in keys closest to the point (x, y), or -1 if
+  // there is none, and its distance.  The distance of the next closest key,
+  // or infinity if there is none, goes into second_distance_mm.  keys have to
+  // be the ones the field was built for.
+  int Find(std::vector<Key> const &keys, int x, int y, double *distance_mm,
+           double *second_distance_mm) const;
+
+  // The distance in mm from the point (x, y) to the closest part of key, 0 if
+  // it's on the key.
+  double DistanceMM(Key const &key, int x, int y) const;
+
+  int cell_width() const { return cell_width_; }
+  int cell_height() const { return cell_height_; }
+  int columns() const { return columns_; }
+  int rows() const { return rows_; }
+  std::vector<uint32_t> const &cell_start() const { return cell_start_; }
+  std::vector<int32_t> const &cell_keys() const { return cell_keys_; }
+
+ private:
+  // The shortest and the longest distance in mm from any point of the area
+  // [xmin, xmax] x [ymin, ymax] to key.
+  void AreaDistanceMM(Key const &key, int xmin, int xmax, int ymin, int ymax,
+                      double *min_mm, double *max_mm) const;
+
+  int cell_width_, cell_height_;
+  int columns_, rows_;
+  double pitch_x_, pitch_y_;
+
+  // The keys listed for cell c are cell_keys_[cell_start_[c]] up to, but not
+  // including, cell_keys_[cell_start_[c + 1]].
+  std::vector<uint32_t> cell_start_;
+  std::vector<int32_t> cell_keys_;
+};
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_KEYGRID_H_
@@ -0,0 +1,100 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "layers.h"
+
+#include <stdlib.h>
+
+namespace touch_keyboard {
+
+namespace {
+
+// The layer key names, by rule.
+struct LayerName {
+  char const *prefix_;
+  LayerRule rule_;
+};
+
+constexpr LayerName kLayerNames[] = {
+  {"LAYER_HOLD_", LayerRule::kHold},
+  {"LAYER_TOGGLE_", LayerRule::kToggle},
+  {"LAYER_ONESHOT_", LayerRule::kOneShot},
+};
+
+}  // namespace
+
+KeyBinding BindingForCode(int code) {
+  if (IsLayerCode(code)) {
+    int offset = code - kLayerCodeBase;
+    return KeyBinding{code, static_cast<LayerRule>(offset / kMaxLayers),
+                      offset % kMaxLayers};
+  }
+  if (code == KEY_FN) {
+    return KeyBinding{code, LayerRule::kHold, 1};
+  }
+  return KeyBinding{code, LayerRule::kNone, 0};
+}
+
+bool ParseLayerName(std::string const &name, int *code) {
+  for (LayerName const &layer_name : kLayerNames) {
+    std::string prefix = layer_name.prefix_;
+    if (name.compare(0, prefix.size(), prefix) != 0) {
+      continue;
+    }
+    char *end;
+    long layer = strtol(name.c_str() + prefix.size(), &end, 10);
+    if (end == name.c_str() + prefix.size() || *end || layer < 1 ||
+        layer >= kMaxLayers) {
+      return false;
+    }
+    *code = LayerCode(layer_name.rule_, layer);
+    return true;
+  }
+  return false;
+}
+
+LayerEngine::LayerEngine() : toggled_(0), one_shot_(0), active_(0) {
+  for (int layer = 0; layer < kMaxLayers; layer++) {
+    holds_[layer] = 0;
+  }
+}
+
+void LayerEngine::Hold(int layer) {
+  holds_[layer]++;
+  Update();
+}
+
+void LayerEngine::Release(int layer) {
+  if (holds_[layer] > 0) {
+    holds_[layer]--;
+  }
+  Update();
+}
+
+void LayerEngine::Toggle(int layer) {
+  toggled_ ^= 1u << layer;
+  Update();
+}
+
+void LayerEngine::OneShot(int layer) {
+  one_shot_ |= 1u << layer;
+  Update();
+}
+
+void LayerEngine::ConsumeOneShots() {
+  one_shot_ = 0;
+  Update();
+}
+
+void LayerEngine::Update() {
+  active_ = 0;
+  for (int layer = kMaxLayers - 1; layer > 0; layer--) {
+    if (holds_[layer] > 0 || ((toggled_ | one_shot_) >> layer) & 1) {
+      active_ = layer;
+      break;
+    }
+  }
+}
+
+}  // namespace touch_keyboard
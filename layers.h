@@ -0,0 +1,94 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_LAYERS_H_
+#define TOUCH_KEYBOARD_LAYERS_H_
+
+#include <linux/input.h>
+#include <stdint.h>
+#include <string>
+
+#include "key.h"
+
+namespace touch_keyboard {
+
+// The ways a key can switch layers.  A held layer is active for as long as
+// its key is held down, a toggled one from one tap on its key until the next,
+// and a one-shot layer only for the next key that is pressed.
+enum class LayerRule {
+  kNone,
+  kHold,
+  kToggle,
+  kOneShot,
+};
+
+// What a key does in one layer: the code it sends and the layer it switches
+// to, if any.
+struct KeyBinding {
+  int code_;
+  LayerRule rule_;
+  int layer_;
+};
+
+// A key named LAYER_HOLD_<n>, LAYER_TOGGLE_<n> or LAYER_ONESHOT_<n> in the
+// layout only switches to layer n and doesn't send anything.  Its code is one
+// of these, beyond every real key code.
+constexpr int kLayerCodeBase = KEY_CNT + 1;
+constexpr int kLayerCodeEnd = kLayerCodeBase +
+                              (static_cast<int>(LayerRule::kOneShot) + 1) *
+                              kMaxLayers;
+
+inline bool IsLayerCode(int code) {
+  return code >= kLayerCodeBase && code < kLayerCodeEnd;
+}
+
+// The code of the key that switches to layer by rule.
+inline int LayerCode(LayerRule rule, int layer) {
+  return kLayerCodeBase + static_cast<int>(rule) * kMaxLayers + layer;
+}
+
+// The binding of a key that sends code.  Layer codes switch layers as
+// described above, and KEY_FN holds layer 1 as well as being sent.
+KeyBinding BindingForCode(int code);
+
+// Parse a layer key name like LAYER_HOLD_2 into its code.  Returns false if
+// name isn't one.
+bool ParseLayerName(std::string const &name, int *code);
+
+class LayerEngine {
+ /* Keeps track of the layers that are switched on.
+  *
+  * The keys of a layout are looked up in the highest layer that is active,
+  * either because a key holding it is down, because it was toggled on or
+  * because it's waiting as a one-shot layer.  Several keys may hold the same
+  * layer at once, it stays active until all of them are released.
+  */
+ public:
+  LayerEngine();
+
+  // The layer to look keys up in, 0 if no other layer is active.
+  int active() const { return active_; }
+
+  void Hold(int layer);
+  void Release(int layer);
+  void Toggle(int layer);
+  void OneShot(int layer);
+
+  // A key that doesn't switch layers was pressed, which ends any one-shot
+  // layers.
+  void ConsumeOneShots();
+
+ private:
+  // Recompute active_ after a change.
+  void Update();
+
+  int holds_[kMaxLayers];
+  uint32_t toggled_;
+  uint32_t one_shot_;
+  int active_;
+};
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_LAYERS_H_
@@ -0,0 +1,446 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "layout.h"
+
+#include <fcntl.h>
+#include <logging.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cmath>
+
+#define CSV_IO_NO_THREAD
+#include "csv.h"
+
+#include "layoutblob.h"
+
+namespace touch_keyboard {
+
+// The default range the maximum pressure of a tap has to be in.
+constexpr int kMinTapPressure = 50;
+constexpr int kMaxTapPressure = 110;
+
+// The size of the cells of the grid used to find keys.  Keys are much larger
+// than this, so each cell only overlaps a few of them.
+constexpr double kKeyGridCellMM = 2.0;
+
+// The default range the maximum contact diameter of a tap has to be in, for
+// sensors that don't report pressure.
+constexpr int kMinTapTouchDiameter = 300;
+constexpr int kMaxTapTouchDiameter = 3000;
+
+// The name that makes a key switch layouts.
+constexpr char kNextLayoutName[] = "NEXT_LAYOUT";
+
+std::shared_ptr<Layout const> Layout::Load(std::string const &path,
+                                           struct hw_config const &hw_config) {
+  std::shared_ptr<Layout> layout(new Layout(path, hw_config));
+
+  // Look at the file as a whole first: it may be compiled already, or be the
+  // source of one of the built in layouts.  An empty file can't be mapped, and
+  // is left for the CSV reader to complain about.
+  std::string origin;
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to open the layout " << path << "\n";
+    return NULL;
+  }
+  struct stat st;
+  void *data = MAP_FAILED;
+  size_t size = 0;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    size = st.st_size;
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  ::close(fd);
+  if (data != MAP_FAILED) {
+    bool is_compiled = size >= sizeof(kLayoutBlobMagic) &&
+        !memcmp(data, kLayoutBlobMagic, sizeof(kLayoutBlobMagic));
+    bool ok = true;
+    if (is_compiled) {
+      ok = layout->ReadBlob(data, size);
+      origin = "its compiled form";
+    } else {
+      layout->source_hash_ = HashBytes(data, size);
+      for (int i = 0; i < kNumBuiltinLayouts && origin.empty(); i++) {
+        BuiltinLayout const &builtin = kBuiltinLayouts[i];
+        LayoutBlobHeader const *header =
+            reinterpret_cast<LayoutBlobHeader const *>(builtin.blob_);
+        if (header->source_hash_ == layout->source_hash_ &&
+            layout->ReadBlob(builtin.blob_, builtin.size_)) {
+          origin = std::string("the built in ") + builtin.name_;
+        }
+      }
+    }
+    munmap(data, size);
+    if (!ok) {
+      LOG(ERROR) << "The compiled layout " << path << " is invalid or was " <<
+                    "compiled for a different touch sensor\n";
+      return NULL;
+    }
+  }
+
+  if (origin.empty()) {
+    try {
+      if (!layout->Read()) {
+        return NULL;
+      }
+    } catch (io::error::base const &e) {
+      LOG(ERROR) << "Unable to load the layout " << path << ": " << e.what() <<
+                    "\n";
+      return NULL;
+    }
+  }
+  LOG(INFO) << "Loaded the layout " << path << " with " <<
+               layout->keys_.size() << " keys" <<
+               (origin.empty() ? "" : " from " + origin) << ".\n";
+  return layout;
+}
+
+bool Layout::Read() {
+  double hw_pitch_x, hw_pitch_y;
+
+  hw_pitch_x = hw_config_.res_x / hw_config_.width_mm;
+  hw_pitch_y = hw_config_.res_y / hw_config_.height_mm;
+
+  LOG(DEBUG) << "pitch: " << hw_pitch_x << "x" << hw_pitch_y << "\n";
+
+  io::CSVReader<17,
+    io::trim_chars<' ', '\t'>,
+    io::no_quote_escape<';'>> l_csv(path_);
+
+  // The columns for the layers past Fn and the tuning columns are optional,
+  // and so is every value in them.
+  l_csv.read_header(io::ignore_missing_column, "x", "y", "width", "height",
+      "name", "code", "name_fn", "code_fn", "name_2", "code_2",
+      "name_3", "code_3", "delay_ms",
+      "min_pressure", "max_pressure", "min_diameter", "max_diameter");
+
+  double x, y, w, h;
+  double left_margin, top_margin;
+  std::array<std::string, kMaxLayers> names;
+  std::array<int, kMaxLayers> codes;
+  KeyParams params;
+  static_assert(kMaxLayers == 4, "The layout has columns for four layers");
+
+  left_margin = hw_config_.left_margin_mm;
+  top_margin = hw_config_.top_margin_mm;
+
+  // Missing columns leave their variables untouched, so the optional values
+  // are reset for every row.
+  while (names.fill(""), codes.fill(0), params = {0, 0, 0, 0, 0},
+         l_csv.read_row(x, y, w, h, names[0], codes[0], names[1], codes[1],
+                        names[2], codes[2], names[3], codes[3],
+                        params.delay_ms_, params.min_pressure_,
+                        params.max_pressure_, params.min_touch_major_,
+                        params.max_touch_major_)) {
+    for (int layer = 0; layer < kMaxLayers; layer++) {
+      if (names[layer] == kNextLayoutName)
+        codes[layer] = kNextLayoutCode;
+      else
+        ParseLayerName(names[layer], &codes[layer]);
+    }
+
+    LOG(DEBUG) << "Key " << names[0] << "(" << codes[0] << ") | " <<
+      names[1] << " (" << codes[1] << ") | " <<
+      names[2] << " (" << codes[2] << ") | " <<
+      names[3] << " (" << codes[3] << "): " <<
+      w << "x" << h << "@(" << x << "," << y << ") mm\n";
+
+    int x1 = 0, x2 = 0, y1 = 0, y2 = 0;
+
+    switch (hw_config_.rotation) {
+      case 0:
+        x1 = (left_margin + x) * hw_pitch_x;
+        x2 = (left_margin + x + w) * hw_pitch_x;
+        y1 = (top_margin + y) * hw_pitch_y;
+        y2 = (top_margin + y + h) * hw_pitch_y;
+        break;
+      case 90:
+        x1 = (top_margin + y) * hw_pitch_x;
+        x2 = (top_margin + y + h) * hw_pitch_x;
+        y1 = (hw_config_.height_mm - (left_margin + x + w)) * hw_pitch_y;
+        y2 = (hw_config_.height_mm - (left_margin + x)) * hw_pitch_y;
+        break;
+      case 180:
+        x1 = (hw_config_.width_mm - (left_margin + x + w)) * hw_pitch_x;
+        x2 = (hw_config_.width_mm - (left_margin + x)) * hw_pitch_x;
+        y1 = (hw_config_.height_mm - (top_margin + y + h)) * hw_pitch_y;
+        y2 = (hw_config_.height_mm - (top_margin + y)) * hw_pitch_y;
+        break;
+      case 270:
+        x1 = (hw_config_.width_mm - (y + h + top_margin)) * hw_pitch_x;
+        x2 = (hw_config_.width_mm - (y + top_margin)) * hw_pitch_x;
+        y1 = (left_margin + x) * hw_pitch_y;
+        y2 = (left_margin + x + w) * hw_pitch_y;
+        break;
+      default:
+        LOG(ERROR) << "Rotation by " << hw_config_.rotation << " degrees is not supported\n";
+        return false;
+    }
+
+    LOG(DEBUG) << "HW coords: (" << x1 << ", " << y1 << "), (" <<
+      x2 << ", " << y2 << ")\n";
+
+    // Rows for the same key that touch each other, like the two halves of
+    // the ISO Enter key, make up one key.  Tuning values may be given on any
+    // of the rows, the first one wins.
+    bool merged = false;
+    for (Key &key : keys_) {
+      if (key.event_codes_ == codes && TouchesKey(key, x1, x2, y1, y2)) {
+        key.AddRect(x1, x2, y1, y2);
+        KeyParams &p = key.params_;
+        p.delay_ms_ = p.delay_ms_ ? p.delay_ms_ : params.delay_ms_;
+        p.min_pressure_ = p.min_pressure_ ? p.min_pressure_ :
+                                            params.min_pressure_;
+        p.max_pressure_ = p.max_pressure_ ? p.max_pressure_ :
+                                            params.max_pressure_;
+        p.min_touch_major_ = p.min_touch_major_ ? p.min_touch_major_ :
+                                                  params.min_touch_major_;
+        p.max_touch_major_ = p.max_touch_major_ ? p.max_touch_major_ :
+                                                  params.max_touch_major_;
+        merged = true;
+        break;
+      }
+    }
+    if (!merged) {
+      keys_.push_back(Key(codes, x1, x2, y1, y2));
+      keys_.back().params_ = params;
+    }
+  }
+
+  ResolveKeyParams();
+  ResolveKeyBindings();
+
+  grid_.Build(keys_, kKeyGridCellMM * hw_pitch_x,
+              kKeyGridCellMM * hw_pitch_y);
+  nearest_.Build(keys_, hw_config_.res_x, hw_config_.res_y,
+                 kKeyGridCellMM * hw_pitch_x, kKeyGridCellMM * hw_pitch_y,
+                 hw_pitch_x, hw_pitch_y);
+  return true;
+}
+
+void Layout::ResolveKeyParams() {
+  params_.clear();
+  max_key_delay_ms_ = 0;
+  for (Key const &key : keys_) {
+    KeyParams params = key.params_;
+    if (params.delay_ms_ < 0) {
+      LOG(WARNING) << "Ignoring the negative delay of key " <<
+                      key.event_codes_[0] << "\n";
+      params.delay_ms_ = 0;
+    }
+    max_key_delay_ms_ = std::max(max_key_delay_ms_, params.delay_ms_);
+
+    // The spacebar is often pressed by a user's thumb, which may have
+    // unusually high pressure, so unless the layout says otherwise it has no
+    // upper limits.
+    bool is_space = key.event_codes_[0] == KEY_SPACE;
+    if (!params.min_pressure_)
+      params.min_pressure_ = kMinTapPressure;
+    if (!params.max_pressure_)
+      params.max_pressure_ = is_space ? INT_MAX : kMaxTapPressure;
+    if (!params.min_touch_major_)
+      params.min_touch_major_ = kMinTapTouchDiameter;
+    if (!params.max_touch_major_)
+      params.max_touch_major_ = is_space ? INT_MAX : kMaxTapTouchDiameter;
+    params_.push_back(params);
+  }
+}
+
+int Layout::FindNearest(int x, int y, double max_distance_mm,
+                        double *confidence) const {
+  double distance, second_distance;
+  int key_num = nearest_.Find(keys_, x, y, &distance, &second_distance);
+  if (key_num < 0 || distance > max_distance_mm) {
+    return -1;
+  }
+  // The confidence falls as the two distances approach each other.
+  if (std::isinf(second_distance)) {
+    *confidence = 1;
+  } else if (second_distance + distance > 0) {
+    *confidence = (second_distance - distance) / (second_distance + distance);
+  } else {
+    *confidence = 0;
+  }
+  return key_num;
+}
+
+bool Layout::ReadBlob(void const *data, size_t size) {
+  if (!IsValidLayoutBlob(data, size)) {
+    return false;
+  }
+  unsigned char const *base = static_cast<unsigned char const *>(data);
+  LayoutBlobHeader const *header =
+      reinterpret_cast<LayoutBlobHeader const *>(base);
+
+  // The keys were converted to the coordinates of one particular sensor.
+  LayoutBlobHWConfig blob_hw_config;
+  ToLayoutBlobHWConfig(hw_config_, &blob_hw_config);
+  if (memcmp(&blob_hw_config, &header->hw_config_, sizeof(blob_hw_config))) {
+    return false;
+  }
+  source_hash_ = header->source_hash_;
+
+  LayoutBlobKey const *blob_keys =
+      reinterpret_cast<LayoutBlobKey const *>(base + header->keys_offset_);
+  KeyRect const *rects =
+      reinterpret_cast<KeyRect const *>(base + header->rects_offset_);
+  keys_.clear();
+  for (uint32_t i = 0; i < header->num_keys_; i++) {
+    LayoutBlobKey const &blob_key = blob_keys[i];
+    KeyRect const *rect = rects + blob_key.first_rect_;
+    std::array<int, kMaxLayers> codes;
+    std::copy(blob_key.event_codes_, blob_key.event_codes_ + kMaxLayers,
+              codes.begin());
+    keys_.push_back(Key(codes, rect->xmin_, rect->xmax_, rect->ymin_,
+                        rect->ymax_));
+    keys_.back().rects_.assign(rect, rect + blob_key.num_rects_);
+    keys_.back().params_ = blob_key.params_;
+  }
+  ResolveKeyParams();
+  ResolveKeyBindings();
+
+  uint32_t const *cells =
+      reinterpret_cast<uint32_t const *>(base + header->cells_offset_);
+  LayoutBlobEntry const *blob_entries =
+      reinterpret_cast<LayoutBlobEntry const *>(base + header->entries_offset_);
+  std::vector<KeyGrid::Entry> entries(header->num_entries_);
+  for (uint32_t i = 0; i < header->num_entries_; i++) {
+    entries[i].rect_ = blob_entries[i].rect_;
+    entries[i].key_ = blob_entries[i].key_;
+  }
+  grid_.Restore(header->grid_xmin_, header->grid_ymin_, header->cell_width_,
+                header->cell_height_, header->columns_, header->rows_,
+                std::vector<uint32_t>(cells, cells + header->num_cells_),
+                entries);
+
+  uint32_t const *field_cells =
+      reinterpret_cast<uint32_t const *>(base + header->field_cells_offset_);
+  int32_t const *field_keys =
+      reinterpret_cast<int32_t const *>(base + header->field_keys_offset_);
+  nearest_.Restore(header->field_cell_width_, header->field_cell_height_,
+                   header->field_columns_, header->field_rows_,
+                   hw_config_.res_x / hw_config_.width_mm,
+                   hw_config_.res_y / hw_config_.height_mm,
+                   std::vector<uint32_t>(field_cells,
+                                         field_cells +
+                                         header->num_field_cells_),
+                   std::vector<int32_t>(field_keys,
+                                        field_keys + header->num_field_keys_));
+  return true;
+}
+
+std::string Layout::ToBlob(uint64_t hw_source_hash) const {
+  // Lay out the header and the arrays one after the other, each of them
+  // starting at a multiple of 8 bytes.
+  auto align = [](size_t offset) { return (offset + 7) & ~size_t(7); };
+  uint32_t num_rects = 0;
+  for (Key const &key : keys_) {
+    num_rects += key.rects_.size();
+  }
+  LayoutBlobHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic_, kLayoutBlobMagic, sizeof(header.magic_));
+  header.version_ = kLayoutBlobVersion;
+  header.source_hash_ = source_hash_;
+  header.hw_source_hash_ = hw_source_hash;
+  ToLayoutBlobHWConfig(hw_config_, &header.hw_config_);
+  header.num_keys_ = keys_.size();
+  header.keys_offset_ = align(sizeof(header));
+  header.num_rects_ = num_rects;
+  header.rects_offset_ = align(header.keys_offset_ +
+                               header.num_keys_ * sizeof(LayoutBlobKey));
+  header.num_cells_ = grid_.cell_start().size();
+  header.cells_offset_ = align(header.rects_offset_ +
+                               header.num_rects_ * sizeof(KeyRect));
+  header.num_entries_ = grid_.entries().size();
+  header.entries_offset_ = align(header.cells_offset_ +
+                                 header.num_cells_ * sizeof(uint32_t));
+  header.num_field_cells_ = nearest_.cell_start().size();
+  header.field_cells_offset_ = align(header.entries_offset_ +
+                                     header.num_entries_ *
+                                     sizeof(LayoutBlobEntry));
+  header.num_field_keys_ = nearest_.cell_keys().size();
+  header.field_keys_offset_ = align(header.field_cells_offset_ +
+                                    header.num_field_cells_ *
+                                    sizeof(uint32_t));
+  header.size_ = align(header.field_keys_offset_ +
+                       header.num_field_keys_ * sizeof(int32_t));
+  header.grid_xmin_ = grid_.xmin();
+  header.grid_ymin_ = grid_.ymin();
+  header.cell_width_ = grid_.cell_width();
+  header.cell_height_ = grid_.cell_height();
+  header.columns_ = grid_.columns();
+  header.rows_ = grid_.rows();
+  header.field_cell_width_ = nearest_.cell_width();
+  header.field_cell_height_ = nearest_.cell_height();
+  header.field_columns_ = nearest_.columns();
+  header.field_rows_ = nearest_.rows();
+
+  std::string blob(header.size_, '\0');
+  memcpy(&blob[0], &header, sizeof(header));
+  uint32_t rect_num = 0;
+  for (uint32_t i = 0; i < header.num_keys_; i++) {
+    Key const &key = keys_[i];
+    LayoutBlobKey blob_key;
+    memset(&blob_key, 0, sizeof(blob_key));
+    std::copy(key.event_codes_.begin(), key.event_codes_.end(),
+              blob_key.event_codes_);
+    blob_key.params_ = key.params_;
+    blob_key.first_rect_ = rect_num;
+    blob_key.num_rects_ = key.rects_.size();
+    memcpy(&blob[header.keys_offset_ + i * sizeof(blob_key)], &blob_key,
+           sizeof(blob_key));
+    memcpy(&blob[header.rects_offset_ + rect_num * sizeof(KeyRect)],
+           key.rects_.data(), key.rects_.size() * sizeof(KeyRect));
+    rect_num += key.rects_.size();
+  }
+  memcpy(&blob[header.cells_offset_], grid_.cell_start().data(),
+         header.num_cells_ * sizeof(uint32_t));
+  for (uint32_t i = 0; i < header.num_entries_; i++) {
+    LayoutBlobEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.rect_ = grid_.entries()[i].rect_;
+    entry.key_ = grid_.entries()[i].key_;
+    memcpy(&blob[header.entries_offset_ + i * sizeof(entry)], &entry,
+           sizeof(entry));
+  }
+  memcpy(&blob[header.field_cells_offset_], nearest_.cell_start().data(),
+         header.num_field_cells_ * sizeof(uint32_t));
+  memcpy(&blob[header.field_keys_offset_], nearest_.cell_keys().data(),
+         header.num_field_keys_ * sizeof(int32_t));
+  return blob;
+}
+
+void Layout::ResolveKeyBindings() {
+  // Keys without a code of their own in a layer send their base code there,
+  // which is filled in here so every layer is complete.
+  bindings_.clear();
+  for (int layer = 0; layer < kMaxLayers; layer++) {
+    for (Key const &key : keys_) {
+      int code = key.event_codes_[layer];
+      bindings_.push_back(BindingForCode(code ? code : key.event_codes_[0]));
+    }
+  }
+}
+
+bool Layout::TouchesKey(Key const &key, int xmin, int xmax,
+                        int ymin, int ymax) {
+  // Allow for a unit of rounding error between the edges.
+  for (KeyRect const &rect : key.rects_) {
+    if (xmin <= rect.xmax_ + 1 && rect.xmin_ <= xmax + 1 &&
+        ymin <= rect.ymax_ + 1 && rect.ymin_ <= ymax + 1) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace touch_keyboard
@@ -0,0 +1,139 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_LAYOUT_H_
+#define TOUCH_KEYBOARD_LAYOUT_H_
+
+#include <linux/input.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base_macros.h"
+#include "hwconfig.h"
+#include "key.h"
+#include "keygrid.h"
+#include "layers.h"
+
+namespace touch_keyboard {
+
+// A key named NEXT_LAYOUT in the layout, in any layer, doesn't send anything
+// but switches to the next layout.  It gets this code, which is beyond every
+// real key code.
+constexpr int kNextLayoutCode = KEY_CNT;
+
+class Layout {
+ /* A keyboard layout mapped onto the touch sensor.
+  *
+  * A Layout holds the keys printed on the sensor, read from a layout CSV file
+  * and converted to sensor coordinates, together with their tuning values and
+  * the index used to find the key under a finger.  A loaded layout never
+  * changes, so it's handed around as a shared_ptr<Layout const>: the keyboard
+  * can switch to another one or replace it with a reloaded copy at any time,
+  * while the fingers that started on the old one keep it alive until they
+  * lift.
+  *
+  * A layout can also be loaded from its compiled form, see layoutblob.h.
+  */
+ public:
+  // Load a layout for the sensor described by hw_config, from either a CSV
+  // file or a compiled one.  A CSV file that a built in layout was compiled
+  // from is not parsed at all, the built in copy is used instead.  Returns
+  // NULL if the file can't be read or is invalid.
+  static std::shared_ptr<Layout const> Load(std::string const &path,
+                                            struct hw_config const &hw_config);
+
+  // Compile the layout into a blob, noting that it was made for a hardware
+  // configuration read from a file with the hash hw_source_hash.
+  std::string ToBlob(uint64_t hw_source_hash) const;
+
+  std::string const &path() const { return path_; }
+
+  std::vector<Key> const &keys() const { return keys_; }
+  int size() const { return keys_.size(); }
+  Key const &key(int key_num) const { return keys_[key_num]; }
+
+  // What the key with index key_num does in layer.
+  KeyBinding const &binding(int layer, int key_num) const {
+    return bindings_[layer * keys_.size() + key_num];
+  }
+
+  // The bindings of every key in every layer.
+  std::vector<KeyBinding> const &bindings() const { return bindings_; }
+
+  // The tuning values of a key, with the defaults filled in.  A delay of 0
+  // stays as it is and stands for the keyboard's delay.
+  KeyParams const &params(int key_num) const { return params_[key_num]; }
+
+  // The longest delay set for any key.
+  int max_key_delay_ms() const { return max_key_delay_ms_; }
+
+  // Return the index of the key that contains the point (x, y) or -1 if there
+  // is none.
+  int Find(int x, int y) const { return grid_.Find(x, y); }
+
+  // Return the index of the key closest to the point (x, y), if it's no more
+  // than max_distance_mm away, or -1.  This is meant for points that aren't on
+  // any key.  How clearly the key was closer than the next closest one goes
+  // into confidence: 1 if there's no other key around, down to 0 if the point
+  // is just as close to another key.
+  int FindNearest(int x, int y, double max_distance_mm,
+                  double *confidence) const;
+
+ private:
+  Layout(std::string const &path, struct hw_config const &hw_config) :
+      path_(path), source_hash_(0), hw_config_(hw_config),
+      max_key_delay_ms_(0) {}
+
+  // Read the CSV file and fill in the keys.
+  bool Read();
+
+  // Fill in the keys, the grid and the field with copies of the arrays in the
+  // blob of size bytes at data, which doesn't have to outlive the layout.
+  // Returns false if it's invalid or was compiled for a different sensor.
+  bool ReadBlob(void const *data, size_t size);
+
+  // Check if the rectangle touches or overlaps any part of key.
+  static bool TouchesKey(Key const &key, int xmin, int xmax,
+                         int ymin, int ymax);
+
+  // Fill in params_ from the keys, with the defaults for any values the
+  // layout left out.
+  void ResolveKeyParams();
+
+  // Fill in bindings_ from the keys.
+  void ResolveKeyBindings();
+
+  std::string path_;
+
+  // The hash of the CSV file the layout was read or compiled from.
+  uint64_t source_hash_;
+
+  struct hw_config hw_config_;
+
+  // This group of Key objects stores the full layout of the keyboard.
+  std::vector<Key> keys_;
+
+  // The tuning values of each key in keys_, at the same index.
+  std::vector<KeyParams> params_;
+
+  // What each key does in each layer, a layer after the other, with the keys
+  // in the same order as in keys_.
+  std::vector<KeyBinding> bindings_;
+  int max_key_delay_ms_;
+
+  // The spatial index of keys_ used to find the key under a finger.
+  KeyGrid grid_;
+
+  // The map of the keys closest to each point, for touches between keys.
+  NearestKeyField nearest_;
+
+  DISALLOW_COPY_AND_ASSIGN(Layout);
+};
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_LAYOUT_H_
@@ -0,0 +1,168 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "layoutblob.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace touch_keyboard {
+
+namespace {
+
+// Check that num records of record_size bytes at offset are all within a blob
+// of blob_size bytes, and aligned for reading them in place.
+bool ArrayFits(uint32_t offset, uint32_t num, size_t record_size,
+               size_t blob_size) {
+  return offset % 8 == 0 && offset <= blob_size &&
+         static_cast<uint64_t>(num) * record_size <= blob_size - offset;
+}
+
+// Check that the num_cells starts of cell lists at data follow each other
+// and end with num_entries.
+bool CellListsFit(unsigned char const *data, uint32_t num_cells,
+                  uint32_t num_entries) {
+  uint32_t const *cells = reinterpret_cast<uint32_t const *>(data);
+  if (cells[0] != 0 || cells[num_cells - 1] != num_entries) {
+    return false;
+  }
+  for (uint32_t i = 1; i < num_cells; i++) {
+    if (cells[i] < cells[i - 1]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+uint64_t HashBytes(void const *data, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  unsigned char const *bytes = static_cast<unsigned char const *>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+bool HashFile(std::string const &path, uint64_t *hash) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  std::string contents;
+  char buffer[4096];
+  ssize_t size;
+  while ((size = ::read(fd, buffer, sizeof(buffer))) > 0) {
+    contents.append(buffer, size);
+  }
+  ::close(fd);
+  if (size < 0) {
+    return false;
+  }
+  *hash = HashBytes(contents.data(), contents.size());
+  return true;
+}
+
+bool IsValidLayoutBlob(void const *data, size_t size) {
+  if (reinterpret_cast<uintptr_t>(data) % 8 ||
+      size < sizeof(LayoutBlobHeader)) {
+    return false;
+  }
+  unsigned char const *base = static_cast<unsigned char const *>(data);
+  LayoutBlobHeader const *header =
+      reinterpret_cast<LayoutBlobHeader const *>(base);
+  if (memcmp(header->magic_, kLayoutBlobMagic, sizeof(header->magic_)) ||
+      header->version_ != kLayoutBlobVersion || header->size_ != size) {
+    return false;
+  }
+  if (!ArrayFits(header->keys_offset_, header->num_keys_,
+                 sizeof(LayoutBlobKey), size) ||
+      !ArrayFits(header->rects_offset_, header->num_rects_, sizeof(KeyRect),
+                 size) ||
+      !ArrayFits(header->cells_offset_, header->num_cells_, sizeof(uint32_t),
+                 size) ||
+      !ArrayFits(header->entries_offset_, header->num_entries_,
+                 sizeof(LayoutBlobEntry), size) ||
+      !ArrayFits(header->field_cells_offset_, header->num_field_cells_,
+                 sizeof(uint32_t), size) ||
+      !ArrayFits(header->field_keys_offset_, header->num_field_keys_,
+                 sizeof(int32_t), size)) {
+    return false;
+  }
+
+  // Every key needs at least one rectangle, and they all have to exist.
+  LayoutBlobKey const *keys =
+      reinterpret_cast<LayoutBlobKey const *>(base + header->keys_offset_);
+  for (uint32_t i = 0; i < header->num_keys_; i++) {
+    if (keys[i].num_rects_ < 1 || keys[i].first_rect_ > header->num_rects_ ||
+        keys[i].num_rects_ > header->num_rects_ - keys[i].first_rect_) {
+      return false;
+    }
+  }
+
+  // The cell lists of the grid and the field have to follow each other and
+  // cover all their entries, and each entry has to name a key.
+  if (header->cell_width_ < 1 || header->cell_height_ < 1 ||
+      header->columns_ < 0 || header->rows_ < 0 ||
+      static_cast<uint64_t>(header->columns_) * header->rows_ + 1 !=
+          header->num_cells_ ||
+      !CellListsFit(base + header->cells_offset_, header->num_cells_,
+                    header->num_entries_)) {
+    return false;
+  }
+  LayoutBlobEntry const *entries =
+      reinterpret_cast<LayoutBlobEntry const *>(base + header->entries_offset_);
+  for (uint32_t i = 0; i < header->num_entries_; i++) {
+    if (entries[i].key_ < 0 ||
+        static_cast<uint32_t>(entries[i].key_) >= header->num_keys_) {
+      return false;
+    }
+  }
+
+  if (header->field_cell_width_ < 1 || header->field_cell_height_ < 1 ||
+      header->field_columns_ < 0 || header->field_rows_ < 0 ||
+      static_cast<uint64_t>(header->field_columns_) * header->field_rows_ + 1 !=
+          header->num_field_cells_ ||
+      !CellListsFit(base + header->field_cells_offset_,
+                    header->num_field_cells_, header->num_field_keys_)) {
+    return false;
+  }
+  int32_t const *field_keys =
+      reinterpret_cast<int32_t const *>(base + header->field_keys_offset_);
+  for (uint32_t i = 0; i < header->num_field_keys_; i++) {
+    if (field_keys[i] < 0 ||
+        static_cast<uint32_t>(field_keys[i]) >= header->num_keys_) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void ToLayoutBlobHWConfig(struct hw_config const &hw_config,
+                          LayoutBlobHWConfig *blob_hw_config) {
+  memset(blob_hw_config, 0, sizeof(*blob_hw_config));
+  blob_hw_config->rotation_ = hw_config.rotation;
+  blob_hw_config->res_x_ = hw_config.res_x;
+  blob_hw_config->res_y_ = hw_config.res_y;
+  blob_hw_config->width_mm_ = hw_config.width_mm;
+  blob_hw_config->height_mm_ = hw_config.height_mm;
+  blob_hw_config->left_margin_mm_ = hw_config.left_margin_mm;
+  blob_hw_config->top_margin_mm_ = hw_config.top_margin_mm;
+}
+
+void FromLayoutBlobHWConfig(LayoutBlobHWConfig const &blob_hw_config,
+                            struct hw_config *hw_config) {
+  hw_config->rotation = blob_hw_config.rotation_;
+  hw_config->res_x = blob_hw_config.res_x_;
+  hw_config->res_y = blob_hw_config.res_y_;
+  hw_config->width_mm = blob_hw_config.width_mm_;
+  hw_config->height_mm = blob_hw_config.height_mm_;
+  hw_config->left_margin_mm = blob_hw_config.left_margin_mm_;
+  hw_config->top_margin_mm = blob_hw_config.top_margin_mm_;
+}
+
+}  // namespace touch_keyboard
@@ -0,0 +1,127 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_LAYOUTBLOB_H_
+#define TOUCH_KEYBOARD_LAYOUTBLOB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "hwconfig.h"
+#include "key.h"
+
+namespace touch_keyboard {
+
+/* The compiled form of a keyboard layout.
+ *
+ * A layout CSV file is compiled for one sensor configuration into a blob that
+ * holds everything a Layout is made of, already converted to sensor
+ * coordinates: the keys with their tuning values, their rectangles, the
+ * KeyGrid index and the NearestKeyField.  Loading it is a matter of checking
+ * the header and copying the arrays, there's nothing to parse or compute.
+ * The blob is made of plain fixed size records at 8 byte aligned offsets, so
+ * the records can be read where they are, in a mapped file or in an array
+ * compiled into the program, without unpacking them first.  The Layout keeps
+ * copies of them though, so a mapped file isn't needed once it's loaded.
+ *
+ * A blob starts with a LayoutBlobHeader, followed by the arrays it points
+ * to.  The CSV files remain the source, the blob remembers hashes of the
+ * ones it was compiled from so it can stand in for them as long as they
+ * don't change.
+ */
+
+constexpr char kLayoutBlobMagic[8] = "TKBDLAY";
+constexpr uint32_t kLayoutBlobVersion = 3;
+
+// The sensor configuration a blob was compiled for.
+struct LayoutBlobHWConfig {
+  int32_t rotation_;
+  int32_t res_x_, res_y_;
+  int32_t padding_;
+  double width_mm_, height_mm_;
+  double left_margin_mm_, top_margin_mm_;
+};
+
+struct LayoutBlobHeader {
+  char magic_[8];
+  uint32_t version_;
+
+  // The size of the whole blob.
+  uint32_t size_;
+
+  // HashBytes() of the layout CSV and the hardware configuration CSV it was
+  // compiled from.
+  uint64_t source_hash_;
+  uint64_t hw_source_hash_;
+  LayoutBlobHWConfig hw_config_;
+
+  // Where the arrays start, counted from the start of the blob, and how many
+  // records they hold.
+  uint32_t keys_offset_, num_keys_;
+  uint32_t rects_offset_, num_rects_;
+  uint32_t cells_offset_, num_cells_;
+  uint32_t entries_offset_, num_entries_;
+
+  // The shape of the KeyGrid.  cells_ holds its columns_ * rows_ + 1 list
+  // starts.
+  int32_t grid_xmin_, grid_ymin_;
+  int32_t cell_width_, cell_height_;
+  int32_t columns_, rows_;
+
+  // The NearestKeyField, which covers the whole sensor starting at (0, 0).
+  // Like for the KeyGrid, field_cells_ holds field_columns_ * field_rows_ + 1
+  // starts of the lists in field_keys_.
+  uint32_t field_cells_offset_, num_field_cells_;
+  uint32_t field_keys_offset_, num_field_keys_;
+  int32_t field_cell_width_, field_cell_height_;
+  int32_t field_columns_, field_rows_;
+};
+
+// A key, made of num_rects_ rectangles starting at rects_[first_rect_].  The
+// tuning values are the ones given in the layout, without defaults.
+struct LayoutBlobKey {
+  int32_t event_codes_[kMaxLayers];
+  KeyParams params_;
+  uint32_t first_rect_, num_rects_;
+};
+
+// An entry of a KeyGrid cell.
+struct LayoutBlobEntry {
+  KeyRect rect_;
+  int32_t key_;
+};
+
+// The 64 bit FNV-1a hash of size bytes at data.
+uint64_t HashBytes(void const *data, size_t size);
+
+// Compute HashBytes() of the contents of the file at path.  Returns false if
+// it can't be read.
+bool HashFile(std::string const &path, uint64_t *hash);
+
+// Check that the size bytes at data are a blob that's safe to read, ie. the
+// header fits, all the arrays are within the blob and all the indices point
+// to records that exist.
+bool IsValidLayoutBlob(void const *data, size_t size);
+
+void ToLayoutBlobHWConfig(struct hw_config const &hw_config,
+                          LayoutBlobHWConfig *blob_hw_config);
+void FromLayoutBlobHWConfig(LayoutBlobHWConfig const &blob_hw_config,
+                            struct hw_config *hw_config);
+
+// The layouts compiled into the program from the layouts/ directory.  They
+// are generated at build time by touch_keyboard_layoutc.
+struct BuiltinLayout {
+  // The name of the CSV file in layouts/.
+  char const *name_;
+  unsigned char const *blob_;
+  size_t size_;
+};
+
+extern BuiltinLayout const kBuiltinLayouts[];
+extern int const kNumBuiltinLayouts;
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_LAYOUTBLOB_H_
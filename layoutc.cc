@@ -0,0 +1,151 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// touch_keyboard_layoutc compiles keyboard layouts for one touch sensor.
+//
+// With an output file, it compiles a single layout CSV file into a blob that
+// touch_keyboard_handler loads in place of the CSV.  With --embed, it writes
+// a C++ source file holding the blobs of all the given layouts, which is how
+// the shipped layouts are built into the handler.
+
+#include <getopt.h>
+#include <logging.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "hwconfig.h"
+#include "layout.h"
+#include "layoutblob.h"
+
+namespace touch_keyboard {
+
+// The compiler has no layouts built in, it's what builds them.
+BuiltinLayout const kBuiltinLayouts[] = {{NULL, NULL, 0}};
+int const kNumBuiltinLayouts = 0;
+
+}  // namespace touch_keyboard
+
+using touch_keyboard::BuiltinLayout;
+using touch_keyboard::HashFile;
+using touch_keyboard::Layout;
+using touch_keyboard::LoadHWConfig;
+
+// Write the blobs as arrays, and the table of built in layouts pointing to
+// them.
+static bool WriteEmbedded(std::string const &path,
+                          std::vector<std::string> const &names,
+                          std::vector<std::string> const &blobs) {
+  std::ofstream out(path.c_str());
+  out << "// Generated by touch_keyboard_layoutc, do not edit.\n\n" <<
+         "#include \"layoutblob.h\"\n\n" <<
+         "namespace touch_keyboard {\n\n" <<
+         "namespace {\n" << std::hex << std::setfill('0');
+  for (unsigned int i = 0; i < blobs.size(); i++) {
+    out << "\n// " << names[i] << "\n" <<
+           "alignas(8) constexpr unsigned char kLayout" << std::dec << i <<
+           std::hex << "[] = {";
+    for (unsigned int j = 0; j < blobs[i].size(); j++) {
+      out << (j % 12 ? " " : "\n   ") << "0x" << std::setw(2) <<
+             static_cast<unsigned int>(
+                 static_cast<unsigned char>(blobs[i][j])) << ",";
+    }
+    out << "\n};\n";
+  }
+  out << "\n}  // namespace\n\n" << std::dec <<
+         "BuiltinLayout const kBuiltinLayouts[] = {\n";
+  for (unsigned int i = 0; i < blobs.size(); i++) {
+    out << "  {\"" << names[i] << "\", kLayout" << i << ", sizeof(kLayout" <<
+           i << ")},\n";
+  }
+  out << "  {NULL, NULL, 0},\n" <<
+         "};\n" <<
+         "int const kNumBuiltinLayouts = " << blobs.size() << ";\n\n" <<
+         "}  // namespace touch_keyboard\n";
+  out.close();
+  if (!out) {
+    LOG(ERROR) << "Unable to write " << path << "\n";
+    return false;
+  }
+  return true;
+}
+
+static const struct option kLongOptions[] = {
+  {"help", no_argument, NULL, 'h'},
+  {"embed", no_argument, NULL, 'e'},
+  {NULL, 0, NULL, 0},
+};
+
+int main(int argc, char *argv[]) {
+  bool embed = false;
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "he", kLongOptions, NULL)) != -1) {
+    switch (opt) {
+      case 'h':
+        std::cerr << "Usage: touch_keyboard_layoutc <touch-hw.csv> <output> <layout.csv>\n" <<
+                     "       touch_keyboard_layoutc --embed <touch-hw.csv> <output.cc> <layout.csv>...\n";
+        return 0;
+      case 'e':
+        embed = true;
+        break;
+      default:
+        std::cerr << "Unknown option " << (char)opt << "\n";
+        exit(EXIT_FAILURE);
+    }
+  }
+  int num_args = argc - optind;
+  if (num_args < 3 || (!embed && num_args != 3)) {
+    std::cerr << "Missing arguments, see --help\n";
+    exit(EXIT_FAILURE);
+  }
+  std::string hw_config_path = argv[optind];
+  std::string output_path = argv[optind + 1];
+
+  // Nothing but errors should be printed while building.
+  SetMinimumLogSeverity(WARNING);
+
+  try {
+    struct touch_keyboard::hw_config hw_config;
+    uint64_t hw_source_hash;
+    if (!HashFile(hw_config_path, &hw_source_hash) ||
+        !LoadHWConfig(hw_config_path, hw_config)) {
+      LOG(ERROR) << "Unable to read the hardware configuration " <<
+                    hw_config_path << "\n";
+      exit(EXIT_FAILURE);
+    }
+
+    std::vector<std::string> names, blobs;
+    for (int i = optind + 2; i < argc; i++) {
+      std::shared_ptr<Layout const> layout = Layout::Load(argv[i], hw_config);
+      if (!layout)
+        exit(EXIT_FAILURE);
+      std::string name = argv[i];
+      names.push_back(name.substr(name.find_last_of('/') + 1));
+      blobs.push_back(layout->ToBlob(hw_source_hash));
+    }
+
+    if (embed) {
+      if (!WriteEmbedded(output_path, names, blobs))
+        exit(EXIT_FAILURE);
+    } else {
+      std::ofstream out(output_path.c_str(), std::ios::binary);
+      out.write(blobs[0].data(), blobs[0].size());
+      out.close();
+      if (!out) {
+        LOG(ERROR) << "Unable to write " << output_path << "\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+  } catch (...) {
+    LOG(ERROR) << "Exception occured";
+    exit(EXIT_FAILURE);
+  }
+
+  return 0;
+}
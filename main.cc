@@ -2,84 +2,206 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <atomic>
+#include <getopt.h>
 #include <logging.h>
-#include <sys/wait.h>
+#include <signal.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <iostream>
-
-#define CSV_IO_NO_THREAD
-#include "csv.h"
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include "fakekeyboard.h"
 #include "faketouchpad.h"
+#include "framequeue.h"
 #include "haptic/touch_ff_manager.h"
+#include "clock.h"
+#include "hwconfig.h"
+#include "palmclassifier.h"
+#include "recording.h"
+#include "touchdecoder.h"
 
 // This filepath is used as the input evdev device. Whichever touch sensor is
 // to be used for touch keyboard input should have a udev rule put in place to
 // set up this symlink.
 constexpr char kTouchSensorDevicePath[] = "/dev/touch_keyboard";
 
+using touch_keyboard::Clock;
+using touch_keyboard::EvdevRecorder;
 using touch_keyboard::FakeTouchpad;
 using touch_keyboard::FakeKeyboard;
+using touch_keyboard::FileSinkSyscallHandler;
+using touch_keyboard::FrameQueue;
+using touch_keyboard::LoadHWConfig;
+using touch_keyboard::PalmClassifier;
+using touch_keyboard::ReplaySyscallHandler;
+using touch_keyboard::SyscallHandler;
+using touch_keyboard::TouchDecoder;
 using touch_keyboard::TouchFFManager;
+using touch_keyboard::VirtualClock;
+
+// Set once SIGTERM or SIGINT asked the handler to stop.
+static std::atomic<bool> stop_requested(false);
+
+// Run the blocking Start() of a consumer on its own thread.  Exceptions can't
+// cross threads, so failures are treated the same as in main().  Returning
+// from Start() is a failure too, unless the consumer was asked to stop.
+template <typename Consumer>
+std::thread StartConsumerThread(Consumer *consumer) {
+  return std::thread([consumer]() {
+    try {
+      consumer->Start();
+    } catch (...) {
+      LOG(ERROR) << "Exception occured";
+    }
+    exit(stop_requested ? EXIT_SUCCESS : EXIT_FAILURE);
+  });
+}
+
+// The keyboard that SIGUSR1 switches to the next layout, and that SIGTERM and
+// SIGINT stop.
+static FakeKeyboard *signal_keyboard = NULL;
 
-bool LoadHWConfig(std::string const &hw_config_file, struct touch_keyboard::hw_config &hw_config) {
-  io::CSVReader<7,
-    io::trim_chars<' ', '\t'>,
-    io::no_quote_escape<';'>> csv(hw_config_file);
-
-  csv.read_header(io::ignore_no_column,
-      "resolution_x", "resolution_y",
-      "width_mm", "height_mm",
-      "left_margin_mm", "top_margin_mm",
-      "rotation_cw");
-
-  int res_x, res_y;
-  double w_mm, h_mm;
-  double left_margin_mm, top_margin_mm;
-  int rotation;
-
-  if (!csv.read_row(res_x, res_y, w_mm, h_mm,
-                    left_margin_mm, top_margin_mm, rotation))
-    return false;
-
-  LOG(INFO) << "Touchpad HW config: " << res_x << "x" << res_y << " points, " <<
-    w_mm << "x" << h_mm << " mm, margins is " <<
-    left_margin_mm << "+" << top_margin_mm <<
-    ", rotated by " << rotation << " deg. clockwise.\n";
-
-  hw_config.res_x = res_x;
-  hw_config.res_y = res_y;
-  hw_config.width_mm = w_mm;
-  hw_config.height_mm = h_mm;
-  hw_config.rotation = rotation;
-  hw_config.left_margin_mm = left_margin_mm;
-  hw_config.top_margin_mm = top_margin_mm;
-
-  return true;
+static void HandleLayoutSwitchSignal(int /* signum */) {
+  if (signal_keyboard)
+    signal_keyboard->RequestNextLayout();
 }
 
+// The keyboard saves what it learned before the handler exits.
+static void HandleStopSignal(int /* signum */) {
+  stop_requested = true;
+  if (signal_keyboard)
+    signal_keyboard->RequestStop();
+}
+
+// Codes for the options that only have a long form.
+enum {
+  kOptionRecord = 256,
+  kOptionReplay,
+  kOptionOutput,
+  kOptionEarlyCommit,
+  kOptionAdaptiveDelay,
+  kOptionDelayRange,
+  kOptionRepeat,
+  kOptionLayout,
+  kOptionGapDistance,
+  kOptionRollover,
+  kOptionPalmRejection,
+  kOptionPalmSize,
+};
+
+static const struct option kLongOptions[] = {
+  {"help", no_argument, NULL, 'h'},
+  {"debug", no_argument, NULL, 'd'},
+  {"grab", no_argument, NULL, 'g'},
+  {"record", required_argument, NULL, kOptionRecord},
+  {"replay", required_argument, NULL, kOptionReplay},
+  {"output", required_argument, NULL, kOptionOutput},
+  {"early-commit", no_argument, NULL, kOptionEarlyCommit},
+  {"adaptive-delay", required_argument, NULL, kOptionAdaptiveDelay},
+  {"delay-range", required_argument, NULL, kOptionDelayRange},
+  {"repeat", required_argument, NULL, kOptionRepeat},
+  {"layout", required_argument, NULL, kOptionLayout},
+  {"gap-distance", required_argument, NULL, kOptionGapDistance},
+  {"rollover", no_argument, NULL, kOptionRollover},
+  {"palm-rejection", no_argument, NULL, kOptionPalmRejection},
+  {"palm-size", required_argument, NULL, kOptionPalmSize},
+  {NULL, 0, NULL, 0},
+};
+
 int main(int argc, char *argv[]) {
   struct touch_keyboard::hw_config hw_config;
   int debug_level = 0;
   int opt;
   double ff_magnitude = 1.0;
   int ff_duration_ms = 4;
+  bool grab_source = false;
+  bool early_commit = false;
+  bool rollover = false;
+  bool palm_rejection = false;
+  int palm_touch_major = touch_keyboard::kDefaultPalmTouchMajor;
+  int palm_touch_minor = touch_keyboard::kDefaultPalmTouchMinor;
+  std::string debounce_state_path;
+  int min_delay_ms = touch_keyboard::kDefaultMinDebounceMS;
+  int max_delay_ms = touch_keyboard::kDefaultMaxDebounceMS;
+  int repeat_delay_ms = 0, repeat_period_ms = 0;
+  std::vector<std::string> extra_layouts;
+  double gap_distance_mm = 0;
+  std::string record_path, replay_path, output_prefix;
 
-  while ((opt = getopt(argc, argv, "hdm:D:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "hdgm:D:", kLongOptions,
+                            NULL)) != -1) {
     switch (opt) {
       case 'h':
-        std::cerr << "Usage: touch_keyboard_handler [-h] [-d] [-m <magnitude>] [-D <duration_ms>]\n";
+        std::cerr << "Usage: touch_keyboard_handler [-h] [-d] [-g] [-m <magnitude>] [-D <duration_ms>]\n" <<
+                     "       [--early-commit] [--rollover] [--adaptive-delay <state file> [--delay-range <min>:<max>]]\n" <<
+                     "       [--repeat <delay>:<period>] [--layout <file>]... [--gap-distance <mm>]\n" <<
+                     "       [--palm-rejection [--palm-size <major>:<minor>]]\n" <<
+                     "       [--record <file>] [--replay <file> [--output <prefix>]]\n";
         return 0;
       case 'd':
         debug_level++;
         break;
+      case 'g':
+        grab_source = true;
+        break;
       case 'm':
         ff_magnitude = atof(optarg);
         break;
       case 'D':
         ff_duration_ms = atoi(optarg);
         break;
+      case kOptionRecord:
+        record_path = optarg;
+        break;
+      case kOptionReplay:
+        replay_path = optarg;
+        break;
+      case kOptionOutput:
+        output_prefix = optarg;
+        break;
+      case kOptionEarlyCommit:
+        early_commit = true;
+        break;
+      case kOptionRollover:
+        rollover = true;
+        break;
+      case kOptionPalmRejection:
+        palm_rejection = true;
+        break;
+      case kOptionPalmSize:
+        if (sscanf(optarg, "%d:%d", &palm_touch_major,
+                   &palm_touch_minor) != 2 ||
+            palm_touch_major <= 0 || palm_touch_minor <= 0) {
+          std::cerr << "Invalid palm size " << optarg << "\n";
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case kOptionAdaptiveDelay:
+        debounce_state_path = optarg;
+        break;
+      case kOptionLayout:
+        extra_layouts.push_back(optarg);
+        break;
+      case kOptionGapDistance:
+        gap_distance_mm = atof(optarg);
+        break;
+      case kOptionRepeat:
+        if (sscanf(optarg, "%d:%d", &repeat_delay_ms, &repeat_period_ms) != 2 ||
+            repeat_delay_ms < 0 || repeat_period_ms <= 0) {
+          std::cerr << "Invalid repeat setting " << optarg << "\n";
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case kOptionDelayRange:
+        if (sscanf(optarg, "%d:%d", &min_delay_ms, &max_delay_ms) != 2 ||
+            min_delay_ms < 0 || max_delay_ms < min_delay_ms) {
+          std::cerr << "Invalid delay range " << optarg << "\n";
+          exit(EXIT_FAILURE);
+        }
+        break;
       default:
         std::cerr << "Unknown option " << (char)opt << "\n";
         exit(EXIT_FAILURE);
@@ -91,28 +213,122 @@ int main(int argc, char *argv[]) {
 
   LOG(INFO) << "Starting touch_keyboard_handler\n";
 
-  LoadHWConfig("touch-hw.csv", hw_config);
+  // When replaying, the recording stands in for the touch sensor and brings
+  // its own hardware configuration along.  Its timestamps are all the time
+  // there is, so nothing waits for the real clock.
+  ReplaySyscallHandler replay(kTouchSensorDevicePath);
+  VirtualClock virtual_clock;
+  SyscallHandler *source_handler = NULL;
+  Clock *clock = NULL;
+  if (!replay_path.empty()) {
+    if (!replay.Load(replay_path))
+      exit(EXIT_FAILURE);
+    hw_config = replay.HWConfig();
+    source_handler = &replay;
+    clock = &virtual_clock;
+  } else {
+    LoadHWConfig("touch-hw.csv", hw_config);
+  }
 
-  // Fork into two processes, one to handle the keyboard functionality
-  // and one to handle the touchpad region.
-  int pid = fork();
+  // The virtual devices may write their events to files instead of uinput.
+  SyscallHandler *touchpad_handler = source_handler;
+  SyscallHandler *keyboard_handler = source_handler;
+  std::unique_ptr<FileSinkSyscallHandler> touchpad_sink, keyboard_sink;
+  if (!output_prefix.empty()) {
+    touchpad_sink.reset(new FileSinkSyscallHandler(
+        output_prefix + ".touchpad", source_handler));
+    keyboard_sink.reset(new FileSinkSyscallHandler(
+        output_prefix + ".keyboard", source_handler));
+    touchpad_handler = touchpad_sink.get();
+    keyboard_handler = keyboard_sink.get();
+  }
 
+  // The touch sensor is read and decoded once, by the decoder running on the
+  // main thread.  Every decoded frame is handed to the keyboard and the
+  // touchpad, which each run on their own thread.
   try {
-    if (pid < 0) {
-      LOG(FATAL) << "ERROR: Unable to fork! (" << pid << ")\n";
-    } else if (pid == 0) {
-      // TODO(charliemooney): Get these coordinates from somewhere not hard-coded
-      LOG(INFO) << "Creating Fake Touchpad.\n";
-      FakeTouchpad tp(hw_config);
-      tp.Start(kTouchSensorDevicePath, "virtual-touchpad");
-    } else {
-      TouchFFManager ffManager(hw_config.res_x, hw_config.res_y,
-          hw_config.rotation, ff_magnitude, ff_duration_ms);
-
-      FakeKeyboard kbd(hw_config, ffManager);
-      kbd.Start(kTouchSensorDevicePath, "virtual-keyboard");
-      wait(NULL);
+    TouchDecoder decoder(source_handler, clock);
+    if (!decoder.Open(kTouchSensorDevicePath))
+      exit(EXIT_FAILURE);
+
+    // Palms are told apart once for both virtual devices, as the frames are
+    // decoded.
+    PalmClassifier palm_classifier(hw_config, palm_touch_major,
+                                   palm_touch_minor);
+    if (palm_rejection)
+      decoder.SetPalmClassifier(&palm_classifier);
+
+    EvdevRecorder recorder;
+    if (!record_path.empty()) {
+      if (!recorder.Open(record_path, hw_config, decoder.source_fd()))
+        exit(EXIT_FAILURE);
+      decoder.SetRecorder(&recorder);
+    }
+
+    FrameQueue touchpad_frames, keyboard_frames;
+    if (!touchpad_frames.Init() || !keyboard_frames.Init())
+      exit(EXIT_FAILURE);
+    decoder.AddConsumer(&touchpad_frames);
+    decoder.AddConsumer(&keyboard_frames);
+
+    // TODO(charliemooney): Get these coordinates from somewhere not hard-coded
+    LOG(INFO) << "Creating Fake Touchpad.\n";
+    FakeTouchpad tp(hw_config, &touchpad_frames, touchpad_handler);
+    if (!tp.Setup(decoder.source_fd(), "virtual-touchpad"))
+      exit(EXIT_FAILURE);
+
+    TouchFFManager ffManager(hw_config.res_x, hw_config.res_y,
+        hw_config.rotation, ff_magnitude, ff_duration_ms);
+
+    FakeKeyboard kbd(hw_config, ffManager, &keyboard_frames,
+                     keyboard_handler, clock);
+    for (std::string const &layout : extra_layouts) {
+      if (!kbd.AddLayout(layout))
+        exit(EXIT_FAILURE);
+    }
+    if (!kbd.Setup("virtual-keyboard"))
+      exit(EXIT_FAILURE);
+    if (early_commit)
+      kbd.SetCommitPolicy(touch_keyboard::CommitPolicy::kEarly);
+    kbd.SetRollover(rollover);
+    if (!debounce_state_path.empty())
+      kbd.SetAdaptiveDelay(debounce_state_path, min_delay_ms, max_delay_ms);
+    kbd.SetAutorepeat(repeat_delay_ms, repeat_period_ms);
+    kbd.SetGapResolution(gap_distance_mm);
+
+    if (!replay_path.empty()) {
+      // Push the recording through the pipeline as fast as possible on this
+      // thread, one frame at a time so the queues never overflow.  The
+      // recorded timestamps decide when the keyboard's events are due.
+      while (decoder.DecodeNextFrame()) {
+        tp.ProcessQueuedFrames();
+        kbd.ProcessQueuedFrames();
+      }
+      kbd.FlushPendingEvents();
+      kbd.LogCommitStats();
+      kbd.SaveDebounceState();
+      LOG(INFO) << "Replay finished.\n";
+      return 0;
     }
+
+    // Only take the sensor away from everybody else once both virtual devices
+    // are up to replace it.  The decoder is the one and only reader of the
+    // sensor, so the grab can't lock any part of this program out.
+    if (grab_source)
+      decoder.GrabSourceDevice(true);
+
+    // Switching layouts is triggered from outside with SIGUSR1, stopping with
+    // SIGTERM or SIGINT.
+    signal_keyboard = &kbd;
+    signal(SIGUSR1, HandleLayoutSwitchSignal);
+    signal(SIGTERM, HandleStopSignal);
+    signal(SIGINT, HandleStopSignal);
+
+    std::thread tp_thread = StartConsumerThread(&tp);
+    std::thread kbd_thread = StartConsumerThread(&kbd);
+
+    decoder.Start();
+    exit(EXIT_FAILURE);
   } catch (...) {
     LOG(ERROR) << "Exception occured";
     exit(EXIT_FAILURE);
@@ -0,0 +1,106 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "palmclassifier.h"
+
+#include <logging.h>
+#include <bitset>
+
+#include "clock.h"
+
+namespace touch_keyboard {
+
+namespace {
+
+// A contact landing this close to a palm is part of it.
+constexpr double kPalmNeighbourMM = 20.0;
+
+// This many contacts landing within kRestingHandWindowMS of each other and
+// no further than kRestingHandMM from the newest one are a resting hand.
+// Typed keys follow each other too slowly for that, even when fast typing
+// makes the fingers overlap.
+constexpr int kRestingHandContacts = 3;
+constexpr int kRestingHandWindowMS = 20;
+constexpr double kRestingHandMM = 40.0;
+
+}  // namespace
+
+PalmClassifier::PalmClassifier(struct hw_config const &hw_config,
+                               int palm_touch_major, int palm_touch_minor) :
+    pitch_x_(hw_config.res_x / hw_config.width_mm),
+    pitch_y_(hw_config.res_y / hw_config.height_mm),
+    palm_touch_major_(palm_touch_major), palm_touch_minor_(palm_touch_minor),
+    palm_slots_(0) {
+  for (int slot = 0; slot < mtstatemachine::kMaxSlots; slot++) {
+    start_times_[slot] = {0, 0};
+  }
+}
+
+bool PalmClassifier::Near(mtstatemachine::MtContact const &a,
+                          mtstatemachine::MtContact const &b,
+                          double distance_mm) const {
+  double dx = (a.finger.x - b.finger.x) / pitch_x_;
+  double dy = (a.finger.y - b.finger.y) / pitch_y_;
+  return dx * dx + dy * dy <= distance_mm * distance_mm;
+}
+
+void PalmClassifier::Classify(mtstatemachine::MtFrame *frame) {
+  mtstatemachine::MtSnapshot const &snapshot = frame->snapshot_;
+  uint32_t old_palm_slots = palm_slots_;
+
+  // A contact that lifted takes its classification with it.
+  palm_slots_ &= ~frame->ended_slots_;
+  for (auto const &contact : snapshot) {
+    if ((frame->started_slots_ >> contact.slot) & 1) {
+      start_times_[contact.slot] = frame->time_;
+    }
+  }
+
+  // Contacts are palms because of their size, whenever they grow to it.
+  for (auto const &contact : snapshot) {
+    struct mtstatemachine::MtFinger const &finger = contact.finger;
+    bool wide = finger.touch_minor >= 0 ?
+                finger.touch_minor >= palm_touch_minor_ :
+                finger.touch_major >= palm_touch_major_;
+    if (wide) {
+      palm_slots_ |= 1u << contact.slot;
+    }
+  }
+
+  // Contacts that just landed are palms because of the contacts around them.
+  for (auto const &contact : snapshot) {
+    uint32_t bit = 1u << contact.slot;
+    if (!(frame->started_slots_ & bit) || (palm_slots_ & bit)) {
+      continue;
+    }
+    bool near_palm = false;
+    uint32_t hand = 0;
+    for (auto const &other : snapshot) {
+      uint32_t other_bit = 1u << other.slot;
+      if ((palm_slots_ & other_bit) &&
+          Near(contact, other, kPalmNeighbourMM)) {
+        near_palm = true;
+      }
+      if (MsBetween(start_times_[other.slot], frame->time_) <=
+              kRestingHandWindowMS &&
+          Near(contact, other, kRestingHandMM)) {
+        hand |= other_bit;
+      }
+    }
+    if (near_palm) {
+      palm_slots_ |= bit;
+    } else if (static_cast<int>(std::bitset<32>(hand).count()) >=
+                   kRestingHandContacts) {
+      palm_slots_ |= hand;
+    }
+  }
+
+  if (palm_slots_ & ~old_palm_slots) {
+    LOG(DEBUG) << "Palms in slots " << std::hex <<
+                  (palm_slots_ & ~old_palm_slots) << std::dec << "\n";
+  }
+  frame->palm_slots_ = palm_slots_;
+}
+
+}  // namespace touch_keyboard
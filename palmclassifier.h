@@ -0,0 +1,69 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_PALMCLASSIFIER_H_
+#define TOUCH_KEYBOARD_PALMCLASSIFIER_H_
+
+#include <time.h>
+
+#include "base_macros.h"
+#include "hwconfig.h"
+#include "statemachine/statemachine.h"
+
+namespace touch_keyboard {
+
+// The contact sizes from which a contact is taken for a palm, unless
+// configured otherwise, in the units of the sensor's ABS_MT_TOUCH_MAJOR and
+// ABS_MT_TOUCH_MINOR axes.
+constexpr int kDefaultPalmTouchMajor = 6000;
+constexpr int kDefaultPalmTouchMinor = 3000;
+
+class PalmClassifier {
+ /* Tells palms and resting hands apart from fingers.
+  *
+  * The classifier looks at every decoded frame before it's handed to the
+  * keyboard and the touchpad, and marks the contacts that aren't fingers in
+  * the frame's palm_slots_.  A contact is a palm if
+  *
+  *  - its ABS_MT_TOUCH_MINOR reaches palm_touch_minor.  A thumb lying flat on
+  *    the space bar is long but narrow, a palm is wide both ways.  If the
+  *    sensor doesn't report the minor axis, a ABS_MT_TOUCH_MAJOR of
+  *    palm_touch_major is used instead.
+  *  - it lands close to a contact that already is a palm, like the heel of
+  *    the hand next to the palm.
+  *  - it lands together with enough other contacts close by, which is a hand
+  *    being put down on the sensor rather than keys being typed.
+  *
+  * Once a contact is a palm it stays one until it lifts.  Everything is
+  * decided from the current frame and a few values per slot, so it costs next
+  * to nothing.
+  */
+ public:
+  PalmClassifier(struct hw_config const &hw_config, int palm_touch_major,
+                 int palm_touch_minor);
+
+  // Fill in frame->palm_slots_.
+  void Classify(mtstatemachine::MtFrame *frame);
+
+ private:
+  // True if the contacts a and b are within distance_mm of each other.
+  bool Near(mtstatemachine::MtContact const &a,
+            mtstatemachine::MtContact const &b, double distance_mm) const;
+
+  // How many sensor units there are to a mm along each axis.
+  double pitch_x_, pitch_y_;
+
+  int palm_touch_major_;
+  int palm_touch_minor_;
+
+  // The slots holding a palm, and when the contact in each slot landed.
+  uint32_t palm_slots_;
+  struct timespec start_times_[mtstatemachine::kMaxSlots];
+
+  DISALLOW_COPY_AND_ASSIGN(PalmClassifier);
+};
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_PALMCLASSIFIER_H_
@@ -0,0 +1,285 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "recording.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "uinputdevice.h"
+
+namespace touch_keyboard {
+
+// The ioctl numbers of the variable sized evdev queries, before the event type
+// or axis code is added to them.
+constexpr unsigned int kEviocgbitBase = _IOC_NR(EVIOCGBIT(0, 0));
+constexpr unsigned int kEviocgabsBase = _IOC_NR(EVIOCGABS(0));
+
+EvdevRecorder::~EvdevRecorder() {
+  if (fd_ >= 0) {
+    syscall_handler_->close(fd_);
+  }
+}
+
+bool EvdevRecorder::Open(std::string const &path,
+                         struct hw_config const &hw_config, int source_fd) {
+  RecordingHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic_, kRecordingMagic, sizeof(header.magic_));
+  header.version_ = kRecordingVersion;
+  header.header_size_ = sizeof(header);
+  header.event_size_ = sizeof(struct input_event);
+  header.rotation_ = hw_config.rotation;
+  header.res_x_ = hw_config.res_x;
+  header.res_y_ = hw_config.res_y;
+  header.width_mm_ = hw_config.width_mm;
+  header.height_mm_ = hw_config.height_mm;
+  header.left_margin_mm_ = hw_config.left_margin_mm;
+  header.top_margin_mm_ = hw_config.top_margin_mm;
+
+  // Capture the axes of the source device so a replay can clone them.
+  int64_t abs_bits = 0;
+  if (syscall_handler_->ioctl(source_fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)),
+                              &abs_bits) < 0) {
+    PLOG(ERROR) << "Unable to query the axes of the source device\n";
+    return false;
+  }
+  header.abs_bits_ = abs_bits;
+  for (int code = 0; code < ABS_CNT; code++) {
+    if ((header.abs_bits_ >> code) & 1) {
+      syscall_handler_->ioctl(source_fd, EVIOCGABS(code),
+                              &header.absinfo_[code]);
+    }
+  }
+
+  fd_ = syscall_handler_->open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                               0644);
+  if (fd_ < 0) {
+    PLOG(ERROR) << "Unable to create recording " << path << "\n";
+    return false;
+  }
+  if (syscall_handler_->write(fd_, &header, sizeof(header)) !=
+      sizeof(header)) {
+    PLOG(ERROR) << "Unable to write the recording header\n";
+    return false;
+  }
+  LOG(INFO) << "Recording touch events to " << path << "\n";
+  return true;
+}
+
+bool EvdevRecorder::Append(struct input_event const *events, int count) {
+  ssize_t size = count * sizeof(struct input_event);
+  if (syscall_handler_->write(fd_, events, size) != size) {
+    PLOG(ERROR) << "Unable to write " << count << " events to the recording\n";
+    return false;
+  }
+  return true;
+}
+
+ReplaySyscallHandler::~ReplaySyscallHandler() {
+  if (data_) {
+    ::munmap(const_cast<uint8_t *>(data_), size_);
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+}
+
+bool ReplaySyscallHandler::Load(std::string const &path) {
+  fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    PLOG(ERROR) << "Unable to open recording " << path << "\n";
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd_, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(RecordingHeader)) {
+    LOG(ERROR) << path << " is too short to be a recording\n";
+    return false;
+  }
+
+  void *data = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (data == MAP_FAILED) {
+    PLOG(ERROR) << "Unable to map recording " << path << "\n";
+    return false;
+  }
+  data_ = static_cast<uint8_t const *>(data);
+  size_ = st.st_size;
+
+  if (memcmp(header()->magic_, kRecordingMagic, sizeof(kRecordingMagic)) ||
+      header()->version_ != kRecordingVersion ||
+      header()->header_size_ != sizeof(RecordingHeader) ||
+      header()->event_size_ != sizeof(struct input_event)) {
+    LOG(ERROR) << path << " is not a compatible recording\n";
+    return false;
+  }
+  offset_ = header()->header_size_;
+
+  LOG(INFO) << "Replaying " << (size_ - offset_) / sizeof(struct input_event) <<
+               " events from " << path << "\n";
+  return true;
+}
+
+struct hw_config ReplaySyscallHandler::HWConfig() const {
+  struct hw_config hw_config;
+  hw_config.rotation = header()->rotation_;
+  hw_config.res_x = header()->res_x_;
+  hw_config.res_y = header()->res_y_;
+  hw_config.width_mm = header()->width_mm_;
+  hw_config.height_mm = header()->height_mm_;
+  hw_config.left_margin_mm = header()->left_margin_mm_;
+  hw_config.top_margin_mm = header()->top_margin_mm_;
+  return hw_config;
+}
+
+int ReplaySyscallHandler::open(const char* pathname, int flags) const {
+  // Opening the sensor yields the recording, anything else is opened as usual.
+  if (sensor_path_ != pathname) {
+    return SyscallHandler::open(pathname, flags);
+  }
+  LOG(DEBUG) << "Replacing " << pathname << " with the recording\n";
+  return fd_;
+}
+
+int ReplaySyscallHandler::close(int fd) const {
+  // The recording stays open for as long as it's mapped.
+  if (fd == fd_) {
+    return 0;
+  }
+  return SyscallHandler::close(fd);
+}
+
+ssize_t ReplaySyscallHandler::read(int fd, void *buf, size_t count) const {
+  if (fd != fd_) {
+    return SyscallHandler::read(fd, buf, count);
+  }
+
+  // Hand out as many whole events as fit, like evdev would.  Once everything
+  // has been read this returns 0, which looks like the device went away.
+  size_t remaining = size_ - offset_;
+  size_t size = std::min(count, remaining);
+  size -= size % sizeof(struct input_event);
+  memcpy(buf, data_ + offset_, size);
+  offset_ += size;
+  return size;
+}
+
+int ReplaySyscallHandler::ioctl(int fd, long request_code,
+                                uint64_t arg1) const {
+  if (fd != fd_) {
+    return SyscallHandler::ioctl(fd, request_code, arg1);
+  }
+  // EVIOCGRAB has nothing to grab.
+  return 0;
+}
+
+int ReplaySyscallHandler::ioctl(int fd, long request_code,
+                                int64_t *arg1) const {
+  if (fd != fd_) {
+    return SyscallHandler::ioctl(fd, request_code, arg1);
+  }
+
+  // Only the EVIOCGBIT queries are expected here.  Report a device with just
+  // the recorded axes.
+  unsigned int nr = _IOC_NR(request_code);
+  unsigned int size = _IOC_SIZE(request_code);
+  if (_IOC_TYPE(request_code) != 'E' || nr < kEviocgbitBase ||
+      nr >= kEviocgbitBase + EV_CNT) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  uint64_t bits = 0;
+  if (nr == kEviocgbitBase) {
+    bits = (1 << EV_SYN) | (1 << EV_ABS);
+  } else if (nr == kEviocgbitBase + EV_ABS) {
+    bits = header()->abs_bits_;
+  }
+  // Like evdev, only copy as much as the bitmap holds, whatever the length
+  // passed in the request.
+  size = std::min<size_t>(size, sizeof(bits));
+  memcpy(arg1, &bits, size);
+  return size;
+}
+
+int ReplaySyscallHandler::ioctl(int fd, long request_code,
+                                int32_t *arg1) const {
+  if (fd != fd_) {
+    return SyscallHandler::ioctl(fd, request_code, arg1);
+  }
+  if (request_code == EVIOCSCLOCKID) {
+    // The recorded timestamps are already on whichever clock was selected
+    // while recording.
+    return 0;
+  }
+  // There is no live state to query for EVIOCGMTSLOTS.
+  errno = EINVAL;
+  return -1;
+}
+
+int ReplaySyscallHandler::ioctl(int fd, long request_code,
+                                struct input_absinfo *arg1) const {
+  if (fd != fd_) {
+    return SyscallHandler::ioctl(fd, request_code, arg1);
+  }
+
+  unsigned int nr = _IOC_NR(request_code);
+  if (_IOC_TYPE(request_code) != 'E' || nr < kEviocgabsBase ||
+      nr >= kEviocgabsBase + ABS_CNT) {
+    errno = EINVAL;
+    return -1;
+  }
+  *arg1 = header()->absinfo_[nr - kEviocgabsBase];
+  return 0;
+}
+
+int FileSinkSyscallHandler::open(const char* pathname, int flags) const {
+  if (strcmp(pathname, kUinputControlFilename) != 0) {
+    return next_->open(pathname, flags);
+  }
+  fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ >= 0) {
+    LOG(INFO) << "Writing uinput events to " << path_ << "\n";
+  }
+  return fd_;
+}
+
+int FileSinkSyscallHandler::ioctl(int fd, long request_code) const {
+  return (fd == fd_) ? 0 : next_->ioctl(fd, request_code);
+}
+
+int FileSinkSyscallHandler::ioctl(int fd, long request_code,
+                                  uint64_t arg1) const {
+  return (fd == fd_) ? 0 : next_->ioctl(fd, request_code, arg1);
+}
+
+int FileSinkSyscallHandler::ioctl(int fd, long request_code,
+                                  int64_t *arg1) const {
+  return (fd == fd_) ? 0 : next_->ioctl(fd, request_code, arg1);
+}
+
+int FileSinkSyscallHandler::ioctl(int fd, long request_code,
+                                  int32_t *arg1) const {
+  return (fd == fd_) ? 0 : next_->ioctl(fd, request_code, arg1);
+}
+
+int FileSinkSyscallHandler::ioctl(int fd, long request_code,
+                                  struct input_absinfo *arg1) const {
+  return (fd == fd_) ? 0 : next_->ioctl(fd, request_code, arg1);
+}
+
+int FileSinkSyscallHandler::ioctl(int fd, long request_code,
+                                  struct uinput_abs_setup *arg1) const {
+  return (fd == fd_) ? 0 : next_->ioctl(fd, request_code, arg1);
+}
+
+int FileSinkSyscallHandler::ioctl(int fd, long request_code,
+                                  struct uinput_setup *arg1) const {
+  return (fd == fd_) ? 0 : next_->ioctl(fd, request_code, arg1);
+}
+
+}  // namespace touch_keyboard
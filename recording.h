@@ -0,0 +1,177 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_RECORDING_H_
+#define TOUCH_KEYBOARD_RECORDING_H_
+
+#include <linux/input.h>
+#include <logging.h>
+#include <stdint.h>
+#include <string>
+
+#include "base_macros.h"
+#include "hwconfig.h"
+#include "syscallhandler.h"
+
+namespace touch_keyboard {
+
+// A recording file starts with a RecordingHeader, directly followed by the raw
+// input_events exactly as they were read from the touch sensor.
+constexpr char kRecordingMagic[8] = "TKBDREC";
+constexpr uint32_t kRecordingVersion = 1;
+
+struct RecordingHeader {
+  char magic_[8];
+  uint32_t version_;
+
+  // The size of this header and of each event, so a recording made on a
+  // machine with a different input_event layout is detected.
+  uint32_t header_size_;
+  uint32_t event_size_;
+
+  // The hardware configuration the recording was made with.
+  int32_t rotation_;
+  int32_t res_x_;
+  int32_t res_y_;
+  double width_mm_;
+  double height_mm_;
+  double left_margin_mm_;
+  double top_margin_mm_;
+
+  // The ABS axes reported by the sensor (one bit per code) and their ranges,
+  // so the virtual touchpad can be cloned from a recording as well.
+  uint64_t abs_bits_;
+  struct input_absinfo absinfo_[ABS_CNT];
+};
+
+class EvdevRecorder {
+ /* Writes every event read from the touch sensor to a recording file.
+  *
+  * Open() queries the source device for its axes and writes the header, after
+  * which each batch of events read by an EvdevSource is appended verbatim with
+  * Append().
+  */
+ public:
+  EvdevRecorder() : syscall_handler_(&default_syscall_handler), fd_(-1) {}
+  explicit EvdevRecorder(SyscallHandler *syscall_handler) :
+      syscall_handler_(syscall_handler), fd_(-1) {
+    if (syscall_handler_ == NULL) {
+      syscall_handler_ = &default_syscall_handler;
+    }
+  }
+
+  ~EvdevRecorder();
+
+  // Create the recording file and write the header describing hw_config and
+  // the source device behind source_fd.
+  bool Open(std::string const &path, struct hw_config const &hw_config,
+            int source_fd);
+
+  // Append count events to the recording.
+  bool Append(struct input_event const *events, int count);
+
+ private:
+  SyscallHandler *syscall_handler_;
+  int fd_;
+
+  DISALLOW_COPY_AND_ASSIGN(EvdevRecorder);
+};
+
+class ReplaySyscallHandler : public SyscallHandler {
+ /* A SyscallHandler that plays a recording back as if it were the sensor.
+  *
+  * The recording is memory-mapped by Load().  Opening sensor_path then yields
+  * a descriptor whose read()s hand out the recorded events as fast as they are
+  * asked for, and whose capability ioctls are answered from the header.  All
+  * other paths and descriptors are passed through to the real syscalls, so
+  * the rest of the pipeline, uinput included, works unchanged.
+  */
+ public:
+  explicit ReplaySyscallHandler(std::string const &sensor_path) :
+      sensor_path_(sensor_path), fd_(-1), data_(NULL), size_(0), offset_(0) {}
+  ~ReplaySyscallHandler();
+
+  // Map the recording and check its header.
+  bool Load(std::string const &path);
+
+  // The hardware configuration stored in the recording.
+  struct hw_config HWConfig() const;
+
+  // True once every recorded event has been read.
+  bool AtEnd() const { return offset_ >= size_; }
+
+  using SyscallHandler::open;
+  using SyscallHandler::ioctl;
+
+  int open(const char* pathname, int flags) const override;
+  int close(int fd) const override;
+  ssize_t read(int fd, void *buf, size_t count) const override;
+  int ioctl(int fd, long request_code, uint64_t arg1) const override;
+  int ioctl(int fd, long request_code, int64_t *arg1) const override;
+  int ioctl(int fd, long request_code, int32_t *arg1) const override;
+  int ioctl(int fd, long request_code,
+            struct input_absinfo *arg1) const override;
+
+ private:
+  RecordingHeader const *header() const {
+    return reinterpret_cast<RecordingHeader const *>(data_);
+  }
+
+  // The path of the sensor the recording stands in for.
+  std::string sensor_path_;
+
+  int fd_;
+  uint8_t const *data_;
+  size_t size_;
+
+  // The read position in the mapping.  read() is logically const for a
+  // SyscallHandler, so this is mutable.
+  mutable size_t offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReplaySyscallHandler);
+};
+
+class FileSinkSyscallHandler : public SyscallHandler {
+ /* A SyscallHandler that turns a UinputDevice into a file writer.
+  *
+  * Opening kUinputControlFilename creates the output file instead, the uinput
+  * ioctls on it succeed without doing anything, so every event the device
+  * sends ends up in the file as a raw input_event.  Any other descriptor
+  * is handed to the next handler, eg. a ReplaySyscallHandler for the source.
+  */
+ public:
+  FileSinkSyscallHandler(std::string const &path, SyscallHandler *next) :
+      path_(path), next_(next), fd_(-1) {
+    if (next_ == NULL) {
+      next_ = &default_syscall_handler;
+    }
+  }
+
+  using SyscallHandler::open;
+
+  int open(const char* pathname, int flags) const override;
+  int ioctl(int fd, long request_code) const override;
+  int ioctl(int fd, long request_code, uint64_t arg1) const override;
+  int ioctl(int fd, long request_code, int64_t *arg1) const override;
+  int ioctl(int fd, long request_code, int32_t *arg1) const override;
+  int ioctl(int fd, long request_code,
+            struct input_absinfo *arg1) const override;
+  int ioctl(int fd, long request_code,
+            struct uinput_abs_setup *arg1) const override;
+  int ioctl(int fd, long request_code,
+            struct uinput_setup *arg1) const override;
+
+ private:
+  std::string path_;
+  SyscallHandler *next_;
+
+  // The output file, once the device has been opened.
+  mutable int fd_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileSinkSyscallHandler);
+};
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_RECORDING_H_
@@ -5,7 +5,6 @@
 #ifndef TOUCH_KEYBOARD_STATEMACHINE_EVENTKEY_H_
 #define TOUCH_KEYBOARD_STATEMACHINE_EVENTKEY_H_
 
-#include <functional>
 #include <linux/input.h>
 #include <stdio.h>
 
@@ -26,7 +25,7 @@ class EventKey {
   explicit EventKey(struct input_event const& ev):
       type_(ev.type), code_(ev.code) {}
 
-  // Define equality so we can use EventKeys as an std::unordered_map key.
+  // Define equality so EventKeys can be compared.
   bool operator==(const EventKey& other) const;
 
   // These Is*() functions identify various types of Events.
@@ -42,16 +41,6 @@ class EventKey {
   int type_, code_;
 };
 
-struct EventKeyHasher {
-  // This defines a functor used to Hash EventKeys so they can be an
-  // std::unordered_map key.  Unordered Maps require a hash function for
-  // whatever datatypes they use as keys.
-  size_t operator()(const EventKey& key) const {
-    return (std::hash<int>()(key.type_) ^
-            (std::hash<int>()(key.code_) << 1) >> 1);
-  }
-};
-
 }  // namespace mtstatemachine
 
 #endif  // TOUCH_KEYBOARD_STATEMACHINE_EVENTKEY_H_
@@ -6,9 +6,9 @@
 #define TOUCH_KEYBOARD_STATEMACHINE_SLOT_H_
 
 #include <linux/input.h>
-#include <unordered_map>
+#include <stdint.h>
 #include <stdio.h>
-#include <vector>
+#include <utility>
 
 #include "statemachine/eventkey.h"
 
@@ -16,20 +16,150 @@ namespace mtstatemachine {
 
 constexpr int kSlotMissingValue = -1;
 
-class Slot : public std::unordered_map<EventKey, int, EventKeyHasher> {
+// The range of event codes a slot has room for: the multitouch ABS axes, from
+// ABS_MT_SLOT up to the last ABS code.
+constexpr int kSlotFirstCode = ABS_MT_SLOT;
+constexpr int kSlotNumCodes = ABS_MAX - ABS_MT_SLOT + 1;
+
+class Slot {
  /* Storage for all the event data for a single multitouch slot
   *
   * Multitouch works by filling "slots" with key-value pairs.  Each slot
   * corresponds with a single finger and is incrementally updated until a SYN
   * event is finally sent, indicating that the slot has been fully updated and
-  * the current values are valid.  This class implements a slot as a mapping
-  * from event keys to their values.  Slots are used by MtStateMachine to
-  * store all the touch information it receives.
+  * the current values are valid.  This class implements a slot as a fixed
+  * array of values indexed by the ABS_MT event code, along with a bitmask of
+  * which codes have been set, so updating and copying it never allocates.
+  * Slots are used by MtStateMachine to store all the touch information it
+  * receives.
+  *
+  * A slot also remembers which of its values have changed since
+  * ClearChanged() was last called, so that consumers of a frame can skip
+  * whatever stayed the same.
+  *
+  * Iterating over a Slot visits the (EventKey, value) pair of every code that
+  * has been set, in order of event code.
   */
  public:
+  typedef std::pair<EventKey, int> value_type;
+
+  class const_iterator {
+   public:
+    const_iterator() :
+        slot_(NULL), index_(kSlotNumCodes), current_(EventKey(EV_ABS, 0), 0) {}
+    const_iterator(Slot const *slot, int index) :
+        slot_(slot), index_(index), current_(EventKey(EV_ABS, 0), 0) {
+      Settle();
+    }
+
+    value_type const &operator*() const { return current_; }
+    value_type const *operator->() const { return &current_; }
+
+    const_iterator &operator++() {
+      index_++;
+      Settle();
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator old = *this;
+      ++(*this);
+      return old;
+    }
+
+    bool operator==(const_iterator const &other) const {
+      return slot_ == other.slot_ && index_ == other.index_;
+    }
+    bool operator!=(const_iterator const &other) const {
+      return !(*this == other);
+    }
+
+   private:
+    // Move forward to the next code that's present (or the end) and load it.
+    void Settle() {
+      while (index_ < kSlotNumCodes && !slot_->IsPresent(index_)) {
+        index_++;
+      }
+      if (index_ < kSlotNumCodes) {
+        current_.first.code_ = kSlotFirstCode + index_;
+        current_.second = slot_->values_[index_];
+      }
+    }
+
+    Slot const *slot_;
+    int index_;
+    value_type current_;
+  };
+
+  Slot() : present_(0), changed_(0) {}
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, kSlotNumCodes); }
+  bool empty() const { return present_ == 0; }
+  void clear() {
+    present_ = 0;
+    changed_ = 0;
+  }
+
   // Scan through the slot's fields for one that matches this event type and
   // code.  If a match is found, return it. Otherwise return kSlotMissingValue.
-  int FindValueByEvent(int ev_type, int ev_code) const;
+  int FindValueByEvent(int ev_type, int ev_code) const {
+    int index = IndexOf(ev_type, ev_code);
+    if (index < 0 || !IsPresent(index)) {
+      return kSlotMissingValue;
+    }
+    return values_[index];
+  }
+
+  // Store the value of this event type and code.  Events a slot has no room
+  // for (anything other than the ABS_MT axes) are ignored and return false.
+  bool SetValue(int ev_type, int ev_code, int value) {
+    int index = IndexOf(ev_type, ev_code);
+    if (index < 0) {
+      return false;
+    }
+    if (!IsPresent(index) || values_[index] != value) {
+      changed_ |= (1u << index);
+    }
+    values_[index] = value;
+    present_ |= (1u << index);
+    return true;
+  }
+
+  // True if this event's value was set to something new since the last
+  // ClearChanged().
+  bool HasChanged(int ev_type, int ev_code) const {
+    int index = IndexOf(ev_type, ev_code);
+    return index >= 0 && ((changed_ >> index) & 1);
+  }
+
+  // True if any value changed since the last ClearChanged().
+  bool changed() const { return changed_ != 0; }
+
+  void ClearChanged() { changed_ = 0; }
+
+  // Treat every value that is set as changed.
+  void MarkAllChanged() { changed_ = present_; }
+
+ private:
+  static int IndexOf(int ev_type, int ev_code) {
+    if (ev_type != EV_ABS || ev_code < kSlotFirstCode ||
+        ev_code >= kSlotFirstCode + kSlotNumCodes) {
+      return -1;
+    }
+    return ev_code - kSlotFirstCode;
+  }
+
+  bool IsPresent(int index) const { return (present_ >> index) & 1; }
+
+  // One bit per entry in values_, set once that code has been given a value.
+  uint32_t present_;
+
+  // One bit per entry in values_, set when that value changed.
+  uint32_t changed_;
+
+  int values_[kSlotNumCodes];
+
+  static_assert(kSlotNumCodes <= 32, "The presence mask is too small");
 };
 
 }  // namespace mtstatemachine
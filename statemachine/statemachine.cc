@@ -6,33 +6,149 @@
 
 namespace mtstatemachine {
 
-bool MtStateMachine::AddEvent(
-    struct input_event const &ev,
-    std::unordered_map<int, struct MtFinger> *out_snapshot) {
+bool MtSnapshot::Add(int slot, int tid, struct MtFinger const &finger) {
+  if (size_ >= kMaxSlots) {
+    return false;
+  }
+  contacts_[size_].slot = slot;
+  contacts_[size_].tid = tid;
+  contacts_[size_].finger = finger;
+  size_++;
+  return true;
+}
+
+MtContact const *MtSnapshot::FindByTrackingID(int tid) const {
+  for (int i = 0; i < size_; i++) {
+    if (contacts_[i].tid == tid) {
+      return &contacts_[i];
+    }
+  }
+  return NULL;
+}
+
+void MtFrame::MarkAllChanged() {
+  changed_slots_ = 0;
+  started_slots_ = 0;
+  ended_slots_ = 0;
+  for (int slot = 0; slot < num_slots_; slot++) {
+    uint32_t bit = 1u << slot;
+    slots_[slot].MarkAllChanged();
+    changed_slots_ |= bit;
+    ended_slots_ |= bit;
+    if (slots_[slot].FindValueByEvent(EV_ABS, ABS_MT_TRACKING_ID) != -1) {
+      started_slots_ |= bit;
+    }
+  }
+}
+
+bool MtStateMachine::AddEvent(struct input_event const &ev,
+                              struct MtFrame *out_frame) {
   // Here we process an event.  This function returns true at the end of a full
   // snapshot of the data (whenever there is a SYN event) and if you
-  // pass it a pointer to an appropriate map, it will fill it with the
-  // current state.  If you pass NULL, it will skip that step.
+  // pass it a pointer to a frame, it will fill it with the current state.
+  // If you pass NULL, it will skip that step.
   EventKey key(ev);
-  if (key.IsSlot()) {
-    slot_ = ev.value;
+  if (key.IsSyn()) {
+    syn_time_.tv_sec = ev.input_event_sec;
+    syn_time_.tv_nsec = ev.input_event_usec * 1000;
+  }
+
+  if (ev.type == EV_SYN && ev.code == SYN_DROPPED) {
+    dropped_ = true;
+    return false;
+  } else if (dropped_) {
+    // Throw away the rest of the partial frame.  Once it's over, the caller
+    // has to rebuild the slots from the device before using them again.
+    if (key.IsSyn()) {
+      dropped_ = false;
+      needs_resync_ = true;
+      return true;
+    }
+    return false;
+  } else if (key.IsSlot()) {
+    SetCurrentSlot(ev.value);
   } else if (key.IsSyn()) {
-    if (out_snapshot) {
-      FillSnapshot(out_snapshot);
+    if (out_frame) {
+      FillFrame(out_frame);
     }
     return true;
-  } else if (ev.type == EV_ABS) {
-    slots_[slot_][key] = ev.value;
+  } else if (ev.type == EV_ABS && slot_ >= 0) {
+    slots_[slot_].SetValue(ev.type, ev.code, ev.value);
   }
   return false;
 }
 
-void MtStateMachine::FillSnapshot(
-    std::unordered_map<int, struct MtFinger> *out_snapshot) {
+int MtStateMachine::SetNumSlots(int num_slots) {
+  if (num_slots > kMaxSlots) {
+    LOG(WARNING) << "The device has " << num_slots << " slots, only the " <<
+                    "first " << kMaxSlots << " are used.\n";
+    num_slots = kMaxSlots;
+  } else if (num_slots < 1) {
+    num_slots = 1;
+  }
+  num_slots_ = num_slots;
+  return num_slots_;
+}
+
+void MtStateMachine::SetCurrentSlot(int slot) {
+  if (slot < 0 || slot >= num_slots_) {
+    // Drop everything sent to this slot rather than writing out of bounds.
+    if (!warned_bad_slot_) {
+      LOG(WARNING) << "Ignoring events for out of range slot " << slot <<
+                      "\n";
+      warned_bad_slot_ = true;
+    }
+    slot_ = -1;
+    return;
+  }
+  slot_ = slot;
+}
+
+void MtStateMachine::SetSlotValue(int slot, int code, int value) {
+  if (slot < 0 || slot >= num_slots_) {
+    return;
+  }
+  slots_[slot].SetValue(EV_ABS, code, value);
+}
+
+void MtStateMachine::FinishResync(struct MtFrame *out_frame) {
+  needs_resync_ = false;
+  if (out_frame) {
+    FillFrame(out_frame);
+    out_frame->resynced_ = true;
+    out_frame->MarkAllChanged();
+  }
+}
+
+void MtStateMachine::FillFrame(struct MtFrame *out_frame) {
+  MtSnapshot *out_snapshot = &out_frame->snapshot_;
   out_snapshot->clear();
+  out_frame->time_ = syn_time_;
+  out_frame->resynced_ = false;
+  out_frame->changed_slots_ = 0;
+  out_frame->started_slots_ = 0;
+  out_frame->ended_slots_ = 0;
+  out_frame->palm_slots_ = 0;
+  out_frame->num_slots_ = num_slots_;
+
+  for (int slot = 0; slot < num_slots_; slot++) {
+    uint32_t bit = 1u << slot;
+    out_frame->slots_[slot] = slots_[slot];
+    if (slots_[slot].changed()) {
+      out_frame->changed_slots_ |= bit;
+      slots_[slot].ClearChanged();
+    }
 
-  for (int slot = 0; slot < kNumSlots; slot++) {
     int tid = slots_[slot].FindValueByEvent(EV_ABS, ABS_MT_TRACKING_ID);
+    if (tid != reported_tids_[slot]) {
+      if (reported_tids_[slot] != -1) {
+        out_frame->ended_slots_ |= bit;
+      }
+      if (tid != -1) {
+        out_frame->started_slots_ |= bit;
+      }
+      reported_tids_[slot] = tid;
+    }
     if (tid == -1) {
       continue;
     }
@@ -42,7 +158,9 @@ void MtStateMachine::FillSnapshot(
     finger.p = slots_[slot].FindValueByEvent(EV_ABS, ABS_MT_PRESSURE);
     finger.touch_major = slots_[slot].FindValueByEvent(EV_ABS,
                                                        ABS_MT_TOUCH_MAJOR);
-    (*out_snapshot)[tid] = finger;
+    finger.touch_minor = slots_[slot].FindValueByEvent(EV_ABS,
+                                                       ABS_MT_TOUCH_MINOR);
+    out_snapshot->Add(slot, tid, finger);
   }
 }
 
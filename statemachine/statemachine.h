@@ -6,21 +6,111 @@
 #define TOUCH_KEYBOARD_STATEMACHINE_STATEMACHINE_H_
 
 #include <linux/input.h>
+#include <logging.h>
 #include <stdio.h>
-#include <unordered_map>
+#include <time.h>
 #include <vector>
 
 #include "statemachine/slot.h"
 
 namespace mtstatemachine {
 
-constexpr int kNumSlots = 10;
+// The number of slots a state machine has room for.  How many of them are
+// actually used depends on the device, see MtStateMachine::SetNumSlots().
+// The change masks in MtFrame have one bit per slot, so this can't grow past
+// 32.
+constexpr int kMaxSlots = 32;
+
+// The number of slots used until the device says otherwise.
+constexpr int kDefaultNumSlots = 10;
+
+static_assert(kMaxSlots <= 32, "Too many slots for the change masks");
 
 // The information reported by a state machine for a single finger
 struct MtFinger {
   int x, y;
   int p;
   int touch_major;
+  int touch_minor;
+};
+
+// An active contact in a frame: the slot it's in, its tracking ID and its data.
+struct MtContact {
+  int slot;
+  int tid;
+  struct MtFinger finger;
+};
+
+class MtSnapshot {
+ /* The active contacts of a single frame.
+  *
+  * The contacts are kept contiguously in a fixed array with room for one per
+  * slot, ordered by slot, so a snapshot can be refilled on every frame and
+  * copied around without allocating.  Iterating over it yields MtContacts.
+  */
+ public:
+  typedef MtContact const *const_iterator;
+
+  MtSnapshot() : size_(0) {}
+
+  const_iterator begin() const { return contacts_; }
+  const_iterator end() const { return contacts_ + size_; }
+  int size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  void clear() { size_ = 0; }
+
+  // Append a contact.  There is only room for one contact per slot, so this
+  // returns false if the snapshot is already full.
+  bool Add(int slot, int tid, struct MtFinger const &finger);
+
+  // Return the contact with this tracking ID, or NULL if there is none.
+  MtContact const *FindByTrackingID(int tid) const;
+
+ private:
+  int size_;
+  MtContact contacts_[kMaxSlots];
+};
+
+// A complete frame as decoded by a MtStateMachine at a SYN event.  It holds
+// the full state of every slot as well as the per-finger snapshot, so anyone
+// handed a frame can act on it without having seen the earlier ones.
+struct MtFrame {
+  // The timestamp the kernel gave the SYN_REPORT that ended this frame, ie.
+  // when the sensor sampled it rather than when it was processed.
+  struct timespec time_;
+
+  // The number of slots the device has.  Only that many entries of slots_
+  // are filled in.
+  int num_slots_;
+
+  // The raw contents of each slot, for consumers that pass values through.
+  Slot slots_[kMaxSlots];
+
+  // The finger data of every active contact.
+  MtSnapshot snapshot_;
+
+  // Set if events were dropped before this frame and the slots were rebuilt
+  // from the device, meaning anything may have happened in between.
+  bool resynced_;
+
+  // What changed since the previous frame, one bit per slot.  A slot is in
+  // changed_slots_ if any of its values changed (and Slot::HasChanged() tells
+  // which), in started_slots_ if it now holds a contact with a new tracking
+  // ID and in ended_slots_ if the contact it held went away.  A slot whose
+  // tracking ID was replaced is in both.
+  uint32_t changed_slots_;
+  uint32_t started_slots_;
+  uint32_t ended_slots_;
+
+  // The slots whose contact was classified as a palm, or as part of a
+  // resting hand, rather than a finger.  See touch_keyboard::PalmClassifier,
+  // this stays empty if there's none.
+  uint32_t palm_slots_;
+
+  // Use when the frames in between may have been missed, eg. after a resync.
+  // Every slot is marked as changed and ended, and the slots with a contact as
+  // started, so a consumer acting on the changes sees the complete state.
+  void MarkAllChanged();
 };
 
 class MtStateMachine {
@@ -31,26 +121,83 @@ class MtStateMachine {
   * instantiate a new MtStateMachine object at the beginning of your program
   * and then continually call AddEvent() to pass the new touch kernel events
   * for processing.  AddEvent() will return 'true' at the end of an entire
-  * frame (SYN event) and then the snapshot map you passed will be populated
-  * and ready for use.  The snapshot is a mapping from tracking IDs to finger
-  * data at the time of the SYN event.
+  * frame (SYN event) and then the MtFrame you passed will be populated
+  * and ready for use.
+  *
+  * If the kernel's buffer overflows it reports a SYN_DROPPED event.  The
+  * events after it up to the next SYN_REPORT are only a partial frame, so they
+  * are discarded and AddEvent() returns true with NeedsResync() set instead of
+  * filling the frame.  The owner is then expected to query the device for
+  * the real slot state, store it with SetCurrentSlot()/SetSlotValue() and
+  * call FinishResync() to get the frame.
+  *
+  * Each frame also records which slots and values changed since the previous
+  * frame, so consumers can skip everything that stayed the same.
+  *
+  * The state machine has room for kMaxSlots slots, of which the first
+  * SetNumSlots() are used.  Events for any slot beyond that are ignored.
   */
  public:
-  MtStateMachine(): slot_(0) {}
+  MtStateMachine(): slot_(0), num_slots_(kDefaultNumSlots), dropped_(false),
+                    needs_resync_(false), warned_bad_slot_(false),
+                    syn_time_({0, 0}) {
+    for (int slot = 0; slot < kMaxSlots; slot++) {
+      reported_tids_[slot] = -1;
+    }
+  }
+
+  // Set how many slots the device reports, ie. the maximum of its ABS_MT_SLOT
+  // axis plus one.  This is clamped to kMaxSlots and returns the number of
+  // slots that will actually be used.
+  int SetNumSlots(int num_slots);
+  int num_slots() const { return num_slots_; }
 
   // Consume an input event and update the internal state.  If this was a SYN
-  // (which means it's the end of a full update) populate out_snapshot with
-  // the current state and return true.  Otherwise leave out_snapshot unchanged
+  // (which means it's the end of a full update) populate out_frame with
+  // the current state and return true.  Otherwise leave out_frame unchanged
   // and return false to indicate there is still more events on the way.
-  bool AddEvent(struct input_event const &ev,
-                std::unordered_map<int, struct MtFinger> *out_snapshot);
+  bool AddEvent(struct input_event const &ev, struct MtFrame *out_frame);
 
+  // True if events were dropped and the slots have to be rebuilt from the
+  // device before the state machine can be trusted again.
+  bool NeedsResync() const { return needs_resync_; }
+
+  // These are used during a resync to overwrite the state with the values
+  // queried from the device.
+  void SetCurrentSlot(int slot);
+  void SetSlotValue(int slot, int code, int value);
+
+  // Conclude a resync and, if out_frame isn't NULL, populate it with the
+  // rebuilt state.
+  void FinishResync(struct MtFrame *out_frame);
+
+  // The slot events currently go to, or -1 if the device selected a slot
+  // that is out of range.
   int slot_;
-  Slot slots_[kNumSlots];
+  Slot slots_[kMaxSlots];
 
  private:
-  // Populate out_snapshot with the current state of the MtStateMachine.
-  void FillSnapshot(std::unordered_map<int, struct MtFinger> *out_snapshot);
+  int num_slots_;
+
+  // Set when a SYN_DROPPED arrives, and cleared by the next SYN_REPORT.  All
+  // events in between are ignored.
+  bool dropped_;
+
+  // Set at the end of a dropped frame until FinishResync() is called.
+  bool needs_resync_;
+
+  // Set once an out of range slot was reported, so it's only logged once.
+  bool warned_bad_slot_;
+
+  // The timestamp of the most recent SYN_REPORT.
+  struct timespec syn_time_;
+
+  // The tracking ID of each slot as of the last frame that was filled, to
+  // find the contacts that started or ended since.
+  int reported_tids_[kMaxSlots];
+
+  // Populate out_frame with the current state of the MtStateMachine.
+  void FillFrame(struct MtFrame *out_frame);
 };
 
 }  // namespace mtstatemachine
@@ -8,9 +8,14 @@
 #include <fcntl.h>
 #include <linux/uinput.h>
 #include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "uinput_definitions.h"
 
@@ -32,6 +37,14 @@ class SyscallHandler {
       return ::open(pathname, flags);
     }
 
+    virtual int open(const char* pathname, int flags, mode_t mode) const {
+      return ::open(pathname, flags, mode);
+    }
+
+    virtual int close(int fd) const {
+      return ::close(fd);
+    }
+
     virtual ssize_t write(int fd, const void *buf, size_t count) const {
       return ::write(fd, buf, count);
     }
@@ -45,6 +58,43 @@ class SyscallHandler {
       return ::select(nfds, readfds, writefds, exceptfds, timeout);
     }
 
+    virtual int epoll_create1(int flags) const {
+      return ::epoll_create1(flags);
+    }
+
+    virtual int epoll_ctl(int epfd, int op, int fd,
+                          struct epoll_event *event) const {
+      return ::epoll_ctl(epfd, op, fd, event);
+    }
+
+    virtual int epoll_wait(int epfd, struct epoll_event *events,
+                           int maxevents, int timeout) const {
+      return ::epoll_wait(epfd, events, maxevents, timeout);
+    }
+
+    virtual int eventfd(unsigned int initval, int flags) const {
+      return ::eventfd(initval, flags);
+    }
+
+    virtual int timerfd_create(int clockid, int flags) const {
+      return ::timerfd_create(clockid, flags);
+    }
+
+    virtual int timerfd_settime(int fd, int flags,
+                                const struct itimerspec *new_value,
+                                struct itimerspec *old_value) const {
+      return ::timerfd_settime(fd, flags, new_value, old_value);
+    }
+
+    virtual int inotify_init1(int flags) const {
+      return ::inotify_init1(flags);
+    }
+
+    virtual int inotify_add_watch(int fd, const char *pathname,
+                                  uint32_t mask) const {
+      return ::inotify_add_watch(fd, pathname, mask);
+    }
+
     virtual int ioctl(int fd, long request_code) const {
       return ::ioctl(fd, request_code);
     }
@@ -57,6 +107,10 @@ class SyscallHandler {
       return ::ioctl(fd, request_code, arg1);
     }
 
+    virtual int ioctl(int fd, long request_code, int32_t *arg1) const {
+      return ::ioctl(fd, request_code, arg1);
+    }
+
     virtual int ioctl(int fd, long request_code,
                       struct input_absinfo *arg1) const {
       return ::ioctl(fd, request_code, arg1);
@@ -0,0 +1,39 @@
+# Replay a recording through touch_keyboard_handler and compare the events
+# the virtual keyboard sent with the expected ones, byte for byte.
+#
+# Run with cmake -P, given
+#   HANDLER   the touch_keyboard_handler to run
+#   SOURCE    the source tree, for the layout files
+#   WORKDIR   an empty directory to run in
+#   RECORDING the recording to replay
+#   EXPECTED  the expected keyboard events, as written by --output
+#   ARGS      extra arguments for the handler, separated by semicolons
+
+# The handler reads its layouts from the current directory.
+file(REMOVE_RECURSE "${WORKDIR}")
+file(MAKE_DIRECTORY "${WORKDIR}")
+configure_file("${SOURCE}/layouts/YB1-X9x-pc105.csv" "${WORKDIR}/layout.csv"
+               COPYONLY)
+configure_file("${SOURCE}/layout-touchpad.csv"
+               "${WORKDIR}/layout-touchpad.csv" COPYONLY)
+configure_file("${SOURCE}/touch-hw.csv" "${WORKDIR}/touch-hw.csv" COPYONLY)
+
+execute_process(
+	COMMAND "${HANDLER}" --replay "${RECORDING}" --output out ${ARGS}
+	WORKING_DIRECTORY "${WORKDIR}"
+	RESULT_VARIABLE result
+	OUTPUT_QUIET
+	ERROR_QUIET
+	)
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "Replaying ${RECORDING} failed: ${result}")
+endif()
+
+execute_process(
+	COMMAND "${CMAKE_COMMAND}" -E compare_files "${WORKDIR}/out.keyboard"
+		"${EXPECTED}"
+	RESULT_VARIABLE result
+	)
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "${WORKDIR}/out.keyboard differs from ${EXPECTED}")
+endif()
@@ -0,0 +1,80 @@
+// Copyright 2016 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "touchdecoder.h"
+
+namespace touch_keyboard {
+
+bool TouchDecoder::Open(std::string const &source_device_path) {
+  if (!OpenSourceDevice(source_device_path)) {
+    return false;
+  }
+
+  // Only track as many slots as the sensor actually has.
+  int num_slots = GetNumSlots();
+  if (num_slots < 0) {
+    LOG(WARNING) << "Unable to query the number of slots, assuming " <<
+                    sm_.num_slots() << ".\n";
+  } else {
+    num_slots = sm_.SetNumSlots(num_slots);
+    LOG(INFO) << "Tracking " << num_slots << " slots.\n";
+  }
+  return true;
+}
+
+void TouchDecoder::Start() {
+  if (!loop_.Init()) {
+    return;
+  }
+  loop_.AddFd(source_fd_, [this]() { HandleSourceReadable(); });
+  loop_.Run();
+}
+
+void TouchDecoder::HandleSourceReadable() {
+  if (!FillEventBuffer()) {
+    return;
+  }
+
+  struct input_event ev;
+  while (GetBufferedEvent(&ev)) {
+    if (sm_.AddEvent(ev, &frame_)) {
+      PublishFrame();
+    }
+  }
+}
+
+bool TouchDecoder::DecodeNextFrame() {
+  struct input_event ev;
+  while (true) {
+    if (!GetBufferedEvent(&ev)) {
+      if (!FillEventBuffer()) {
+        return false;
+      }
+      continue;
+    }
+    if (sm_.AddEvent(ev, &frame_)) {
+      PublishFrame();
+      return true;
+    }
+  }
+}
+
+void TouchDecoder::PublishFrame() {
+  if (sm_.NeedsResync()) {
+    ResyncStateMachine(&sm_, &frame_);
+  }
+  if (!monotonic_timestamps_) {
+    // The kernel's timestamps can't be compared with monotonic deadlines,
+    // so fall back to stamping the frame when it was decoded.
+    frame_.time_ = clock_->Now();
+  }
+  if (palm_classifier_) {
+    palm_classifier_->Classify(&frame_);
+  }
+  for (FrameQueue *queue : consumers_) {
+    queue->Push(frame_);
+  }
+}
+
+}  // namespace touch_keyboard
@@ -0,0 +1,95 @@
+// Copyright 2016 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TOUCH_KEYBOARD_TOUCHDECODER_H_
+#define TOUCH_KEYBOARD_TOUCHDECODER_H_
+
+#include <string>
+#include <vector>
+
+#include "base_macros.h"
+#include "clock.h"
+#include "eventloop.h"
+#include "evdevsource.h"
+#include "framequeue.h"
+#include "palmclassifier.h"
+#include "statemachine/statemachine.h"
+
+namespace touch_keyboard {
+
+class TouchDecoder : public EvdevSource {
+ /* The single reader of the touch sensor.
+  *
+  * The TouchDecoder is the only thing that reads from the source touch
+  * sensor.  It runs the events through one MtStateMachine and publishes every
+  * completed frame to any number of consumers (the FakeKeyboard and the
+  * FakeTouchpad) through their own FrameQueue.  That way the events are only
+  * buffered by the kernel, read and decoded once no matter how many virtual
+  * devices are fed from the sensor.
+  *
+  * To use it, call Open() with the device path, hook up the consumers' queues
+  * with AddConsumer() and then call Start(), which blocks forever.
+  */
+ public:
+  TouchDecoder() : clock_(&default_clock), palm_classifier_(NULL) {}
+
+  // The clock stamps frames if the kernel's timestamps can't be used.  Either
+  // argument may be NULL to use the default.
+  explicit TouchDecoder(SyscallHandler *syscall_handler, Clock *clock = NULL) :
+      EvdevSource(syscall_handler), loop_(syscall_handler),
+      clock_(clock == NULL ? &default_clock : clock), palm_classifier_(NULL) {}
+
+  // Open the source touch sensor.
+  bool Open(std::string const &source_device_path);
+
+  // Publish all decoded frames to this queue from now on.
+  void AddConsumer(FrameQueue *queue) { consumers_.push_back(queue); }
+
+  // Have every frame classified by classifier before it's published, so the
+  // consumers can leave palms alone.
+  void SetPalmClassifier(PalmClassifier *classifier) {
+    palm_classifier_ = classifier;
+  }
+
+  // The file descriptor of the source device, so the consumers can query its
+  // capabilities during their set up.
+  int source_fd() const { return source_fd_; }
+
+  // Loop forever reading and decoding the source device.
+  void Start();
+
+  // Instead of Start(), this can be used to step through the events one frame
+  // at a time, eg. when replaying a recording.  It reads until one frame has
+  // been published and returns false once the source has no events left.
+  bool DecodeNextFrame();
+
+ private:
+  // Called by the event loop when the source device has events to read.
+  void HandleSourceReadable();
+
+  // Finish frame_ once the state machine has completed it and copy it into
+  // each consumer's queue.
+  void PublishFrame();
+
+  EventLoop loop_;
+  Clock *clock_;
+
+  // The one state machine all touch events go through.
+  mtstatemachine::MtStateMachine sm_;
+
+  // The frame being decoded, reused for every frame before it's copied into
+  // each consumer's queue.
+  mtstatemachine::MtFrame frame_;
+
+  // Marks the palms in each frame, if set.
+  PalmClassifier *palm_classifier_;
+
+  std::vector<FrameQueue *> consumers_;
+
+  DISALLOW_COPY_AND_ASSIGN(TouchDecoder);
+};
+
+}  // namespace touch_keyboard
+
+#endif  // TOUCH_KEYBOARD_TOUCHDECODER_H_
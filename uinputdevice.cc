@@ -194,6 +194,8 @@ bool UinputDevice::FinalizeUinputCreation(
 bool UinputDevice::SendEvent(int ev_type, int ev_code, int value) const {
   // Send an input event to the kernel through this uinput device.
   struct input_event ev;
+  ev.input_event_sec = event_time_.tv_sec;
+  ev.input_event_usec = event_time_.tv_nsec / 1000;
   ev.type = ev_type;
   ev.code = ev_code;
   ev.value = value;
@@ -36,9 +36,9 @@ class UinputDevice {
   */
  public:
   UinputDevice() : syscall_handler_(&default_syscall_handler),
-                   uinput_fd_(-1) {}
+                   uinput_fd_(-1), event_time_({0, 0}) {}
   explicit UinputDevice(SyscallHandler *syscall_handler) :
-      syscall_handler_(syscall_handler), uinput_fd_(-1) {
+      syscall_handler_(syscall_handler), uinput_fd_(-1), event_time_({0, 0}) {
     // This constructor allows you to pass in a SyscallHandler when unit
     // testing this class.  For real use, allow it to use the default value
     // by using the constructor with no arguments.
@@ -76,10 +76,22 @@ class UinputDevice {
   // to the input subsystem just like a normal input device.
   bool SendEvent(int ev_type, int ev_code, int value) const;
 
+  // Set the timestamp that SendEvent() puts on the events it sends until the
+  // next call.  The input core stamps events on arrival, but this keeps the
+  // written events fully initialized and consistent with the touch frame
+  // that caused them.
+  void SetEventTime(struct timespec const &time) { event_time_ = time; }
+
+  // The handler for any other syscalls a subclass needs.
+  SyscallHandler *syscall_handler() const { return syscall_handler_; }
+
  private:
   SyscallHandler *syscall_handler_;
   int uinput_fd_;
 
+  // The timestamp to put on outgoing events.
+  struct timespec event_time_;
+
   // A helper function that determines if an event is supported by a device
   // when trying to clone its capabilities.
   bool IsEventSupported(int event, int64_t *supported_event_types) const;